@@ -1,3 +1,6 @@
+#ifndef BITOPS_H
+#define BITOPS_H
+
 #ifdef CONFIG_64BIT
 #define BITS_PER_LONG 64
 #else
@@ -35,3 +38,66 @@
 #define NBITS(n) (n==0?0:NBITS32(n))
 
 #define EXTRACT_NBITS(nr, h, l) ((nr&GENMASK(h,l)) >> l)
+
+/*
+ * Bitmap helpers over arrays of unsigned long. BITS_PER_LONG above follows
+ * CONFIG_64BIT and sizes the 32bit PTE masks, so bitmaps take their word
+ * width from the host type instead.
+ */
+#define BITS_PER_ULONG          (BITS_PER_BYTE * sizeof(unsigned long))
+#define BITMAP_WORD(nr)         ((nr) / BITS_PER_ULONG)
+#define BITMAP_MASK(nr)         (1UL << ((nr) % BITS_PER_ULONG))
+
+static inline void set_bit(int nr, unsigned long *addr)
+{
+	addr[BITMAP_WORD(nr)] |= BITMAP_MASK(nr);
+}
+
+static inline void clear_bit(int nr, unsigned long *addr)
+{
+	addr[BITMAP_WORD(nr)] &= ~BITMAP_MASK(nr);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return (addr[BITMAP_WORD(nr)] & BITMAP_MASK(nr)) != 0;
+}
+
+/*
+ * find_first_bit - index of the lowest set bit in the first @size bits of
+ * @addr, or @size when none is set. Cost is BITS_TO_LONGS(@size) words.
+ */
+static inline int find_first_bit(const unsigned long *addr, int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(size); i++)
+		if (addr[i])
+			return i * BITS_PER_ULONG + __builtin_ctzl(addr[i]);
+
+	return size;
+}
+
+/*
+ * find_next_bit - index of the lowest set bit at or above @start in the
+ * first @size bits of @addr, or @size when none is set.
+ */
+static inline int find_next_bit(const unsigned long *addr, int size, int start)
+{
+	unsigned int i;
+	unsigned long word;
+
+	if (start >= size)
+		return size;
+	i = BITMAP_WORD(start);
+	word = addr[i] & (~0UL << (start % BITS_PER_ULONG));
+	while (!word) {
+		if (++i >= BITS_TO_LONGS(size))
+			return size;
+		word = addr[i];
+	}
+	start = i * BITS_PER_ULONG + __builtin_ctzl(word);
+	return start < size ? start : size;
+}
+
+#endif /* BITOPS_H */
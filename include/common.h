@@ -3,6 +3,7 @@
 
 /* Define structs and routine could be used by every source files */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef OSCFG_H
@@ -39,9 +40,13 @@ struct inst_t {
 	uint32_t arg_2;
 };
 
+/* Read-only once loaded, shared by the processes of one program */
 struct code_seg_t {
 	struct inst_t * text;
 	uint32_t size;
+	int refcnt;		// Processes and cache entries using it
+	void * map;		// Compiled program mapping text points into
+	size_t map_size;
 };
 
 struct trans_table_t {
@@ -89,6 +94,8 @@ struct pcb_t {
 	struct page_table_t * page_table; // Page table
 	uint32_t bp;	// Break pointer
 
+	struct pcb_t * admit_next; // Link in the scheduler admission queue
+
 };
 
 #endif
@@ -3,7 +3,36 @@
 
 #include "common.h"
 
-struct pcb_t * load(const char * path);
+/*
+ * Compiled program format, produced by progc from a text program:
+ * a prog_header followed by [size] packed struct inst_t. load() maps
+ * such a file and runs the instructions in place, no parsing and no
+ * copy. The layout is the host's, files are not portable.
+ */
+#define PROG_MAGIC	0x474f5250	/* "PROG" little endian */
+#define PROG_VERSION	1
+
+struct prog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t priority;
+	uint32_t size;		// Number of instructions
+};
+
+/* Programs already read by a simulation, see loader.c */
+struct prog_cache;
+
+struct prog_cache * init_prog_cache(void);
+void free_prog_cache(struct prog_cache * cache);
+
+/* Load the program at [path] into a new process numbered [pid]. With a
+ * [cache] the process shares the program's code segment with every
+ * other process loaded from [path], otherwise it gets a private one.
+ * NULL if the program is missing or malformed */
+struct pcb_t * load(struct prog_cache * cache, const char * path, uint32_t pid);
+
+/* Drop a process's reference on its code segment */
+void release_code(struct code_seg_t * code);
 
 #endif
 
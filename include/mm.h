@@ -21,6 +21,8 @@
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
+/* Set on every access to an online page, replacement policies clear it */
+#define PAGING_PTE_REFERENCED_MASK PAGING_PTE_EMPTY01_MASK
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
@@ -60,7 +62,8 @@
 /* SWAPFPN */
 #define PAGING_SWP_LOBIT NBITS(PAGING_PAGESZ)
 #define PAGING_SWP_HIBIT (NBITS(PAGING_MEMSWPSZ) - 1)
-#define PAGING_SWP(pte) ((pte&PAGING_SWP_MASK) >> PAGING_SWPFPN_OFFSET)
+#define PAGING_SWP(pte) GETVAL(pte,PAGING_PTE_SWPOFF_MASK,PAGING_PTE_SWPOFF_LOBIT)
+#define PAGING_PTE_FPN(pte) GETVAL(pte,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
 
 /* Value operators */
 #define SETBIT(v,mask) (v=v|mask)
@@ -116,6 +119,7 @@ int __free(struct pcb_t *caller, int vmaid, int rgid);
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data);
 int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
+void free_mm(struct mm_struct *mm);
 
 /* CPUTLB prototypes */
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp);
@@ -154,16 +158,71 @@ int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
 int find_victim_page(struct pcb_t *caller, struct framephy_struct *re_fp);
+int swap_out_page(struct pcb_t *caller, struct framephy_struct *vic, int *swpfpn);
+int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller);
+int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller);
+int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_freefps(struct memphy_struct *mp, int *fpns, int n);
+int MEMPHY_put_freefps(struct memphy_struct *mp, const int *fpns, int n);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_read_bytes(struct memphy_struct *mp, int addr, BYTE *buf, int n);
+int MEMPHY_write_bytes(struct memphy_struct *mp, int addr, const BYTE *buf, int n);
+int MEMPHY_copy_frame(struct memphy_struct *mpsrc, int srcfpn,
+                      struct memphy_struct *mpdst, int dstfpn);
+int MEMPHY_exchange_frames(struct memphy_struct *mp1, int fpn1,
+                           struct memphy_struct *mp2, int fpn2);
+int MEMPHY_fill_frame(struct memphy_struct *mp, int fpn, BYTE value);
 int MEMPHY_dump(struct memphy_struct * mp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int free_memphy(struct memphy_struct *mp);
 int MEMPHY_free_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_map_frame(struct memphy_struct *mp, int fpn, struct mm_struct *owner,
+                     int pgn, struct pcb_t *p_owner);
+int MEMPHY_unmap_frame(struct memphy_struct *mp, int fpn);
+struct frame_entry *MEMPHY_frame(struct memphy_struct *mp, int fpn);
+void MEMPHY_take_touched(struct memphy_struct *mp);
+int MEMPHY_next_touched(struct memphy_struct *mp, int addr);
+
+/* Page replacement policies, see mm-policy.c */
+struct pg_policy {
+   const char *name;
+   /* FPN of the used frame of [mp] to evict, -1 if there is none */
+   int (*find_victim)(struct memphy_struct *mp);
+};
+
+extern const struct pg_policy pg_policy_fifo;
+extern const struct pg_policy pg_policy_clock;
+extern const struct pg_policy pg_policy_aging;
+const struct pg_policy *pg_policy_by_name(const char *name);
+
+/* Default seek cost of a sequential device, see MEMPHY_mv_csr() */
+#ifndef MEMPHY_SEEK_BASE
+#define MEMPHY_SEEK_BASE	100
+#endif
+#ifndef MEMPHY_SEEK_RATE
+#define MEMPHY_SEEK_RATE	1
+#endif
+
+#define MEMPHY_NR_FRAMES(mp)	DIV_ROUND_UP((mp)->maxsz, PAGING_PAGESZ)
+
+/* Note a write to frame [fpn], see memphy_struct.touched */
+static inline void MEMPHY_touch_frame(struct memphy_struct *mp, int fpn)
+{
+   __atomic_fetch_or(&mp->touched[BITMAP_WORD(fpn)], BITMAP_MASK(fpn),
+                     __ATOMIC_RELAXED);
+}
+
+/* Note a write to [addr] */
+static inline void MEMPHY_touch(struct memphy_struct *mp, int addr)
+{
+   MEMPHY_touch_frame(mp, addr / PAGING_PAGESZ);
+}
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
@@ -3,14 +3,17 @@
 
 #define MLQ_SCHED 1
 #define MAX_PRIO 140
+//#define SCHED_PERCPU /* Per-CPU ready queues with work stealing */
+//#define TIMER_FASTFWD /* Skip time slots in which every device is idle */
+//#define SIM_LOCKSTEP_CPUS /* CPU threads step a slot one at a time in os-des order, same trace as os-des */
 
 #define CPU_TLB
 #define CPUTLB_FIXED_TLBSZ
 #define MM_PAGING
+//#define MM_SEQ_SWAP /* Swap devices are sequential, see MEMPHY_SEEK_BASE */
 //#define MM_FIXED_MEMSZ
 //#define VMDBG 1
 #define MMDBG 1
-#define IODUMP 1
-#define PAGETBL_DUMP 1
+#define TRACE_MAX_LEVEL 3 /* Highest trace level built in, see trace.h */
 
 #endif
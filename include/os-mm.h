@@ -1,6 +1,8 @@
 #ifndef OSMM_H
 #define OSMM_H
 
+#include <sys/types.h> /* pthread_mutex_t */
+
 // #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
 #define PAGING_MAX_SYMTBL_SZ 30
@@ -71,6 +73,21 @@ struct framephy_struct {
    struct pcb_t *p_owner;
 };
 
+/*
+ * Frame table entry, a device keeps one per frame indexed by FPN. Used
+ * frames are chained oldest first through fifo_prev and fifo_next
+ */
+struct frame_entry {
+   struct mm_struct *owner;	// NULL while the frame holds no page
+   struct pcb_t *p_owner;
+   uint32_t pid;
+   int pgn;			// Page of owner held in the frame
+   uint8_t age;			// Reference history, see pg_policy_aging
+   int swpfpn;			// RAM frames: swap copy of the page, -1 if none
+   int fifo_prev;		// FPNs, -1 ends the chain
+   int fifo_next;
+};
+
 struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
@@ -78,14 +95,36 @@ struct memphy_struct {
    
    /* Sequential device fields */ 
    int rdmflg;
-   int cursor;
+   int cursor;		// Head position, where the last access left it
+   int seek_base;	// Cost of starting a seek
+   int seek_rate;	// Cost per byte the head travels
+   unsigned long nr_seeks;
+   unsigned long seek_cost;	// Total cost of the seeks so far
+
+   /* Bit per PAGING_PAGESZ frame written since the last dump, set
+    * atomically as writers may not hold the lock. A dump moves the bits
+    * to [dumping] under the lock and prints only those frames, so it
+    * costs the frames changed since the previous dump */
+   unsigned long *touched;
+   unsigned long *dumping;
 
    /* Management structure */
-   struct framephy_struct *free_fp_list;
-   struct framephy_struct *used_fp_list;
+   int *free_fpn;	// Stack of free frames, the top is taken first
+   int nr_free;
+   unsigned long *free_map;	// Bit per frame on the free stack
+   int nr_frames;
+   struct frame_entry *frames;	// Frame table
+   int fifo_head;		// Oldest used frame, -1 when none is used
+   int fifo_tail;		// Newest used frame
+   const struct pg_policy *policy;	// Page replacement, FIFO when NULL
+   int clock_hand;		// Next frame pg_policy_clock looks at
 
    int hit_time;
    int miss_time;
+
+   /* Serializes the processes sharing this device. Swap frames are
+    * changed with the RAM lock held, a swap lock is taken inside it */
+   pthread_mutex_t lock;
 };
 
 #endif
@@ -4,10 +4,13 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
+/* Initial ring capacity, must be a power of two. Queues double on demand */
+#define QUEUE_INIT_SIZE 16
 
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
+	struct pcb_t ** proc;	// Ring buffer, NULL until the first enqueue
+	uint32_t head;		// Index of the oldest process
+	uint32_t cap;		// Capacity, always a power of two
 	int size;
 #ifdef MLQ_SCHED
 	int slot;
@@ -20,5 +23,8 @@ struct pcb_t * dequeue(struct queue_t * q);
 
 int empty(struct queue_t * q);
 
+/* Release the ring buffer, the queue can be reused afterwards */
+void free_queue(struct queue_t * q);
+
 #endif
 
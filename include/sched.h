@@ -1,5 +1,5 @@
-#ifndef QUEUE_H
-#define QUEUE_H
+#ifndef SCHED_H
+#define SCHED_H
 
 #include "common.h"
 
@@ -7,24 +7,33 @@
 #define MLQ_SCHED
 #endif
 
+#ifndef MAX_PRIO
 #define MAX_PRIO 139
+#endif
+
+/* Ready queues of one simulation, every instance owns its own */
+struct sched_struct;
+
+int queue_empty(struct sched_struct * sched);
 
-int queue_empty(void);
+struct sched_struct * init_scheduler(int num_cpus);
+void finish_scheduler(struct sched_struct * sched);
 
-void init_scheduler(void);
-void finish_scheduler(void);
+/* Bind the calling thread to CPU [cpu], selecting its ready queue
+ * when SCHED_PERCPU is configured */
+void sched_bind_cpu(int cpu);
 
 /* Get the next process from ready queue */
-struct pcb_t * get_proc(void);
+struct pcb_t * get_proc(struct sched_struct * sched);
 
 /* Put a process back to run queue */
-void put_proc(struct pcb_t * proc);
+void put_proc(struct sched_struct * sched, struct pcb_t * proc);
 
 /* Add a new process to ready queue */
-void add_proc(struct pcb_t * proc);
+void add_proc(struct sched_struct * sched, struct pcb_t * proc);
 
 /*End a proc when it is done*/
-void end_proc(struct pcb_t ** proc);
+void end_proc(struct sched_struct * sched, struct pcb_t ** proc);
 
 #endif
 
@@ -4,25 +4,78 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include "trace.h"
+
+struct timer_struct;
+
+/* A device synchronized on the time slot barrier */
 struct timer_id_t {
-	int done;
-	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	int done;	// Arrived in the current slot, waiting for the next
+	int fsh;	// Detached
+	int ordered;	// Steps in attach order, see slot_turn_wait()
+	struct timer_struct * timer;	// Clock the device is attached to
+	struct trace_buf trace;	// Trace of the device's thread, written out
+				// at every slot boundary in attach order
+	struct trace_buf events;	// Its event log records, likewise
 };
 
-void start_timer();
+/* Clock of one simulation, every instance owns its own */
+struct timer_struct {
+	struct timer_id_container_t * dev_list;
+	uint64_t time;
+	int started;
+	struct trace_ctx * trace;	// Where the devices' traces are written out
+	/*
+	 * Time slot barrier. The upper half of barrier counts attached
+	 * devices, the lower half counts devices yet to arrive in the
+	 * current slot. The device whose arrival (or detach) empties the
+	 * lower half advances the clock and bumps seq, on which everyone
+	 * else waits.
+	 */
+	uint64_t barrier;
+	uint32_t seq;
+	/* Earliest slot any device asked to run in, collected over the
+	 * arrivals of the current slot (TIMER_FASTFWD) */
+	uint64_t wake_min;
+	/*
+	 * Ordered device whose step is due in the current slot, NULL once
+	 * all of them arrived. Every move bumps turn_seq, on which the
+	 * devices waiting for their turn sleep.
+	 */
+	struct timer_id_container_t * turn;
+	uint32_t turn_seq;
+};
+
+/* Set up a stopped clock at slot 0 with no device attached, writing
+ * the slot lines and the devices' traces out to [trace] */
+void init_timer(struct timer_struct * timer, struct trace_ctx * trace);
+
+void start_timer(struct timer_struct * timer);
 
-void stop_timer();
+void stop_timer(struct timer_struct * timer);
 
-struct timer_id_t * attach_event();
+struct timer_id_t * attach_event(struct timer_struct * timer);
 
 void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
-uint64_t current_time();
+/* No slot is infinitely far away */
+#define TIMER_NEVER	UINT64_MAX
+
+/* Same as next_slot, hinting that the device has nothing to do before
+ * slot [wake]. With TIMER_FASTFWD, when every device is idle the clock
+ * jumps straight to the earliest wake slot */
+void idle_slot(struct timer_id_t* timer_id, uint64_t wake);
+
+/* Wait until [timer_id] may step in the current slot. Ordered devices
+ * step one at a time in attach order, the others only after all of them */
+void slot_turn_wait(struct timer_id_t* timer_id);
+
+/* Arrive at the current slot like idle_slot without waiting for the next
+ * one. For a single thread that steps every device itself */
+void post_slot(struct timer_id_t* timer_id, uint64_t wake);
+
+uint64_t current_time(struct timer_struct * timer);
 
 #endif
@@ -0,0 +1,155 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef OSCFG_H
+#include "os-cfg.h"
+#endif
+
+/*
+ * Leveled simulation trace. A message of some level is printed when
+ * the level is at most the runtime verbosity (os -v) of the thread's
+ * trace_ctx. Levels above TRACE_MAX_LEVEL are not built in at all: the
+ * test folds to a constant 0 and the compiler drops the call with its
+ * arguments, so a production build pays nothing for the dumps.
+ */
+#define TRACE_NONE	0
+#define TRACE_EVENT	1	/* Time slots, loads, dispatches */
+#define TRACE_IO	2	/* Every memory instruction */
+#define TRACE_DUMP	3	/* Page table and memory dumps after them */
+
+/* Legacy switches of os-cfg.h map onto levels */
+#ifndef TRACE_MAX_LEVEL
+#if defined(PAGETBL_DUMP)
+#define TRACE_MAX_LEVEL	TRACE_DUMP
+#elif defined(IODUMP)
+#define TRACE_MAX_LEVEL	TRACE_IO
+#else
+#define TRACE_MAX_LEVEL	TRACE_EVENT
+#endif
+#endif
+
+/*
+ * Where one simulation's trace goes. Every instance owns one and its
+ * threads bind it with trace_bind(), so instances in one process keep
+ * separate verbosities, outputs and event logs.
+ */
+struct trace_ctx {
+	int level;	// Runtime verbosity, TRACE_MAX_LEVEL unless lowered
+	FILE * out;	// Trace text, NULL for stdout
+	FILE * evfile;	// Event log, NULL while event logging is off
+};
+
+/* Context of the calling thread, a read-only stdout one until bound */
+extern __thread struct trace_ctx * trace_ctx_cur;
+
+/* Set up [ctx] at [level] printing to [out], with no event log */
+void trace_ctx_init(struct trace_ctx * ctx, int level, FILE * out);
+
+/* Stream the text of [ctx] goes to */
+FILE * trace_stream(struct trace_ctx * ctx);
+
+#define trace_ctx_on(ctx, lvl) \
+	((lvl) <= TRACE_MAX_LEVEL && (lvl) <= (ctx)->level)
+
+#define trace_on(lvl)	trace_ctx_on(trace_ctx_cur, lvl)
+
+#define trace(level, ...) do {			\
+	if (trace_on(level))			\
+		trace_printf(__VA_ARGS__);	\
+} while (0)
+
+/*
+ * Trace text a thread collects instead of writing stdout itself. The
+ * owner of the buffers writes them out in a fixed order (the timer
+ * does so at every slot boundary), so threads never contend on stdout
+ * and a slot's lines come out grouped by device. That fixes the line
+ * order only: what the devices do in a slot is fixed by the order they
+ * step in, see slot_turn_wait().
+ */
+struct trace_buf {
+	char * data;
+	size_t len;
+	size_t cap;
+};
+
+/* Trace the calling thread under [ctx] (NULL for the stdout default),
+ * its text to [buf], NULL for straight to the context's stream, and its
+ * events to [events] as played by CPU [cpu] (-1 for the loader) */
+void trace_bind(struct trace_ctx * ctx, struct trace_buf * buf,
+		struct trace_buf * events, int cpu);
+
+/* printf to the calling thread's buffer, or its context's stream when
+ * it has none */
+void trace_printf(const char * fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* Write out and empty [buf] to the stream of [ctx] */
+void trace_flush(struct trace_ctx * ctx, struct trace_buf * buf);
+
+void trace_free(struct trace_buf * buf);
+
+/*
+ * Binary event log (os -e). Every event is one fixed size record, so
+ * logging costs a few stores instead of a printf, and tracedump turns
+ * the log back into text or statistics offline. Records go to the
+ * events buffer bound to the thread and get their slot stamped when
+ * the buffer is written out, so emitters need not know the clock.
+ */
+enum trace_ev_type {
+	EV_LOAD,	// arg: prio
+	EV_DISPATCH,
+	EV_PREEMPT,
+	EV_FINISH,
+	EV_ALLOC,	// arg: region, size
+	EV_FREE,	// arg: region
+	EV_PGFAULT,	// arg: page
+	EV_SWAPIN,	// arg: page, RAM frame
+	EV_SWAPOUT,	// arg: page, swap frame
+	EV_TLBHIT,	// arg: region, offset
+	EV_TLBMISS,	// arg: region, offset
+	EV_WRITEBACK,	// arg: page, swap frame; a swap out that copied the page
+	EV_NR_TYPES
+};
+
+struct trace_ev {
+	uint32_t time;
+	uint32_t pid;
+	uint8_t type;
+	uint8_t cpu;	// TRACE_EV_NOCPU outside of a CPU
+	uint16_t pad;
+	uint32_t arg[2];
+};
+
+#define TRACE_EV_NOCPU	0xff
+
+/* Log file header, the records follow it */
+struct trace_ev_hdr {
+	char magic[4];		// TRACE_EV_MAGIC
+	uint16_t version;	// TRACE_EV_VERSION
+	uint16_t rec_size;	// sizeof(struct trace_ev)
+};
+
+#define TRACE_EV_MAGIC		"OSEV"
+#define TRACE_EV_VERSION	2	/* 1 had a 16 bit pid, tracedump reads both */
+
+#define trace_ev(type, pid, a0, a1) do {			\
+	if (trace_ctx_cur->evfile != NULL)			\
+		trace_event(type, pid, a0, a1);			\
+} while (0)
+
+/* Start the log of [ctx] in [path]. Return 0 on success */
+int trace_ev_open(struct trace_ctx * ctx, const char * path);
+
+void trace_ev_close(struct trace_ctx * ctx);
+
+void trace_event(int type, uint32_t pid, uint32_t a0, uint32_t a1);
+
+/* Stamp the records of [events] with slot [time], write them to the
+ * log of [ctx] and empty the buffer */
+void trace_ev_flush(struct trace_ctx * ctx, struct trace_buf * events,
+		uint64_t time);
+
+#endif
@@ -0,0 +1,916 @@
+
+#include "sched.h"
+#include "timer.h"
+#include "queue.h"
+#include "loader.h"
+#include "mm.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Simulator microbenchmarks, one per hot path:
+ *   queue     enqueue()/dequeue() on one ready queue
+ *   dispatch  get_proc()/put_proc() with every thread playing a CPU
+ *   admit     add_proc() bursts while the CPUs keep dispatching
+ *   slots     next_slot() barrier with idle devices
+ *   mm_*      __alloc()/__free(), free frame get/put one at a time and
+ *             in batches, pg_getval()/pg_setval() on resident
+ *             pages, the frame copies or exchange of a swap, swap-out
+ *             to a sequential 16MB device and MEMPHY_dump()
+ *   tlb_*     tlb_cache_write()/tlb_cache_read()
+ *   load_*    load() of a text and a compiled program
+ *
+ * Every result is one line of key=value pairs:
+ *   bench=<name> [params] ops=<n> ops_per_sec=<x> p50_ns=<x> p99_ns=<x>
+ * Latencies are per operation, sampled over batches of BENCH_BATCH ops.
+ * Usage: bench [name...] runs only the benchmarks with a listed name.
+ */
+
+#define BENCH_NUM_PROCS	256
+#define BENCH_ITERS	200000
+#define BENCH_BURST	4096
+#define BENCH_SLOTS	20000
+#define BENCH_BATCH	64	/* Ops timed together for one latency sample */
+#define BENCH_MM_PAGES	64	/* Resident pages touched by the mm benchmarks */
+#define BENCH_MM_ROUNDS	2000
+#define BENCH_FRAME_BATCH	16	/* Frames per batched get/put */
+#define BENCH_PROG_SIZE	1000	/* Instructions in the loaded program */
+#define BENCH_LOADS	2000
+
+#ifdef SCHED_PERCPU
+#define BENCH_SCHED_MODE	"percpu"
+#else
+#define BENCH_SCHED_MODE	"global"
+#endif
+
+/* Per op latency samples */
+struct bench_lat {
+	double * ns;
+	long nr;
+	long cap;
+};
+
+struct bench_args {
+	struct sched_struct * sched;
+	pthread_barrier_t * start;
+	int cpu;
+	long iters;
+	long dispatched;
+	struct bench_lat lat;
+	uint64_t t_start, t_end;	// When this thread began and finished
+};
+
+static int bench_argc;
+static char ** bench_argv;
+/* Keeps the traces of the code under test out of the report, every
+ * thread binds it */
+static struct trace_ctx bench_trace;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Whether benchmark [name] was asked for, all run without arguments */
+static int selected(const char * name) {
+	int i;
+
+	if (bench_argc == 0)
+		return 1;
+	for (i = 0; i < bench_argc; i++)
+		if (!strcmp(bench_argv[i], name))
+			return 1;
+	return 0;
+}
+
+static void lat_init(struct bench_lat * lat, long ops) {
+	lat->cap = ops / BENCH_BATCH + 1;
+	lat->ns = malloc(lat->cap * sizeof(double));
+	lat->nr = 0;
+}
+
+/* Record a batch of [ops] operations that took [ns] */
+static void lat_add(struct bench_lat * lat, uint64_t ns, long ops) {
+	if (lat->nr < lat->cap && ops > 0)
+		lat->ns[lat->nr++] = (double)ns / ops;
+}
+
+/* Append the samples of [from] to [to] */
+static void lat_merge(struct bench_lat * to, struct bench_lat * from) {
+	long i;
+
+	for (i = 0; i < from->nr; i++) {
+		if (to->nr == to->cap)
+			break;
+		to->ns[to->nr++] = from->ns[i];
+	}
+}
+
+static int cmp_double(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double lat_pct(struct bench_lat * lat, int pct) {
+	if (lat->nr == 0)
+		return 0;
+	return lat->ns[(lat->nr - 1) * pct / 100];
+}
+
+/* Print the result line of a benchmark and release its samples */
+static void report(const char * name, const char * params, long ops,
+		uint64_t elapsed, struct bench_lat * lat) {
+	qsort(lat->ns, lat->nr, sizeof(double), cmp_double);
+	printf("bench=%s%s%s ops=%ld ops_per_sec=%.0f p50_ns=%.1f p99_ns=%.1f\n",
+		name, params[0] ? " " : "", params, ops,
+		elapsed ? ops * 1e9 / elapsed : 0,
+		lat_pct(lat, 50), lat_pct(lat, 99));
+	fflush(stdout);
+	free(lat->ns);
+}
+
+/* Steady state of one ready queue holding [BENCH_NUM_PROCS] processes:
+ * every op moves the head process to the tail */
+static void bench_queue(void) {
+	struct pcb_t * procs = calloc(BENCH_NUM_PROCS, sizeof(struct pcb_t));
+	struct queue_t q = { 0 };
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	long i, j;
+
+	for (i = 0; i < BENCH_NUM_PROCS; i++)
+		enqueue(&q, &procs[i]);
+	lat_init(&lat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH; j++)
+			enqueue(&q, dequeue(&q));
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	report("queue", "", i, t1 - t0, &lat);
+
+	free_queue(&q);
+	free(procs);
+}
+
+static void * dispatch_routine(void * args) {
+	struct bench_args * ba = (struct bench_args *)args;
+	uint64_t b;
+	long i, j;
+
+	sched_bind_cpu(ba->cpu);
+	trace_bind(&bench_trace, NULL, NULL, -1);
+	pthread_barrier_wait(ba->start);
+	ba->t_start = now_ns();
+	for (i = 0; i < ba->iters; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH; j++) {
+			struct pcb_t * proc = get_proc(ba->sched);
+			if (proc != NULL) {
+				ba->dispatched++;
+				put_proc(ba->sched, proc);
+			}
+		}
+		lat_add(&ba->lat, now_ns() - b, BENCH_BATCH);
+	}
+	ba->t_end = now_ns();
+	return NULL;
+}
+
+/* Dispatch latency with [num_cpus] threads, all processes on [prio] */
+static void bench_dispatch(int num_cpus, uint32_t prio) {
+	pthread_t * cpu = malloc(num_cpus * sizeof(pthread_t));
+	struct bench_args * args = malloc(num_cpus * sizeof(struct bench_args));
+	struct pcb_t * procs = calloc(BENCH_NUM_PROCS, sizeof(struct pcb_t));
+	pthread_barrier_t start;
+	struct sched_struct * sched;
+	struct bench_lat lat;
+	long dispatched = 0, calls = 0;
+	char params[80];
+	uint64_t t0, t1;
+	int i;
+
+	sched = init_scheduler(num_cpus);
+	for (i = 0; i < BENCH_NUM_PROCS; i++) {
+		procs[i].pid = i + 1;
+		procs[i].prio = prio;
+		add_proc(sched, &procs[i]);
+	}
+
+	pthread_barrier_init(&start, NULL, num_cpus + 1);
+	for (i = 0; i < num_cpus; i++) {
+		args[i].sched = sched;
+		args[i].start = &start;
+		args[i].cpu = i;
+		args[i].iters = BENCH_ITERS / num_cpus / BENCH_BATCH * BENCH_BATCH;
+		args[i].dispatched = 0;
+		lat_init(&args[i].lat, args[i].iters);
+		pthread_create(&cpu[i], NULL, dispatch_routine, &args[i]);
+	}
+	pthread_barrier_wait(&start);
+	for (i = 0; i < num_cpus; i++)
+		pthread_join(cpu[i], NULL);
+
+	/* The workers may start before this thread leaves the barrier, so
+	 * time from the first of them to start to the last to finish */
+	t0 = args[0].t_start;
+	t1 = args[0].t_end;
+	lat_init(&lat, BENCH_ITERS + num_cpus * BENCH_BATCH);
+	for (i = 0; i < num_cpus; i++) {
+		if (args[i].t_start < t0)
+			t0 = args[i].t_start;
+		if (args[i].t_end > t1)
+			t1 = args[i].t_end;
+		calls += args[i].iters;
+		dispatched += args[i].dispatched;
+		lat_merge(&lat, &args[i].lat);
+		free(args[i].lat.ns);
+	}
+	snprintf(params, sizeof(params), "mode=%s cpus=%d prio=%u hits=%ld",
+		BENCH_SCHED_MODE, num_cpus, prio, dispatched);
+	report("dispatch", params, calls, t1 - t0, &lat);
+
+	finish_scheduler(sched);
+	pthread_barrier_destroy(&start);
+	free(procs);
+	free(args);
+	free(cpu);
+}
+
+/* Loader side cost of a burst of [BENCH_BURST] arrivals in one slot
+ * while [num_cpus] threads keep dispatching */
+static void bench_admit(int num_cpus) {
+	pthread_t * cpu = malloc(num_cpus * sizeof(pthread_t));
+	struct bench_args * args = malloc(num_cpus * sizeof(struct bench_args));
+	struct pcb_t * procs = calloc(BENCH_BURST, sizeof(struct pcb_t));
+	pthread_barrier_t start;
+	struct sched_struct * sched;
+	struct bench_lat lat;
+	char params[80];
+	uint64_t t0, t1, b;
+	int i, j;
+
+	sched = init_scheduler(num_cpus);
+	pthread_barrier_init(&start, NULL, num_cpus + 1);
+	for (i = 0; i < num_cpus; i++) {
+		args[i].sched = sched;
+		args[i].start = &start;
+		args[i].cpu = i;
+		args[i].iters = BENCH_ITERS / num_cpus / BENCH_BATCH * BENCH_BATCH;
+		args[i].dispatched = 0;
+		lat_init(&args[i].lat, args[i].iters);
+		pthread_create(&cpu[i], NULL, dispatch_routine, &args[i]);
+	}
+	lat_init(&lat, BENCH_BURST);
+	t0 = now_ns();	/* Before the barrier lets the dispatchers go */
+	pthread_barrier_wait(&start);
+	for (i = 0; i < BENCH_BURST; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++) {
+			procs[j].pid = j + 1;
+			procs[j].prio = j % MAX_PRIO;
+			add_proc(sched, &procs[j]);
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	for (i = 0; i < num_cpus; i++) {
+		pthread_join(cpu[i], NULL);
+		free(args[i].lat.ns);
+	}
+
+	snprintf(params, sizeof(params), "mode=%s cpus=%d",
+		BENCH_SCHED_MODE, num_cpus);
+	report("admit", params, BENCH_BURST, t1 - t0, &lat);
+
+	finish_scheduler(sched);
+	pthread_barrier_destroy(&start);
+	free(procs);
+	free(args);
+	free(cpu);
+}
+
+struct slot_args {
+	struct timer_id_t * timer_id;
+	struct bench_lat * lat;	// Only sampled by the first device
+};
+
+static void * slot_routine(void * args) {
+	struct slot_args * sa = (struct slot_args *)args;
+	uint64_t b;
+	int i, j;
+
+	trace_bind(&bench_trace, NULL, NULL, -1);
+	for (i = 0; i < BENCH_SLOTS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH; j++)
+			next_slot(sa->timer_id);
+		if (sa->lat != NULL)
+			lat_add(sa->lat, now_ns() - b, BENCH_BATCH);
+	}
+	detach_event(sa->timer_id);
+	return NULL;
+}
+
+/* Time slots per second when [num_cpus] devices do nothing but wait on
+ * the slot barrier */
+static void bench_slots(int num_cpus) {
+	pthread_t * cpu = malloc(num_cpus * sizeof(pthread_t));
+	struct slot_args * args = malloc(num_cpus * sizeof(struct slot_args));
+	struct timer_struct timer;
+	struct bench_lat lat;
+	char params[32];
+	uint64_t t0, t1;
+	int i;
+
+	init_timer(&timer, &bench_trace);
+	lat_init(&lat, BENCH_SLOTS);
+	for (i = 0; i < num_cpus; i++) {
+		args[i].timer_id = attach_event(&timer);
+		args[i].lat = i == 0 ? &lat : NULL;
+	}
+
+	start_timer(&timer);
+	t0 = now_ns();
+	for (i = 0; i < num_cpus; i++)
+		pthread_create(&cpu[i], NULL, slot_routine, &args[i]);
+	for (i = 0; i < num_cpus; i++)
+		pthread_join(cpu[i], NULL);
+	t1 = now_ns();
+	stop_timer(&timer);
+
+	snprintf(params, sizeof(params), "cpus=%d", num_cpus);
+	report("slots", params, (BENCH_SLOTS + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH,
+		t1 - t0, &lat);
+
+	free(args);
+	free(cpu);
+}
+
+#ifdef MM_PAGING
+/* A process with a fresh mm on [ram] and [swp], set up the way
+ * ld_step() in os.c does it */
+static struct pcb_t * mm_proc(struct memphy_struct * ram,
+		struct memphy_struct * swp, struct memphy_struct * tlb) {
+	struct pcb_t * proc = calloc(1, sizeof(struct pcb_t));
+
+	proc->pid = 1;
+	proc->mm = calloc(1, sizeof(struct mm_struct));
+	init_mm(proc->mm, proc);
+	proc->mram = ram;
+	proc->active_mswp = swp;
+#ifdef CPU_TLB
+	proc->tlb = tlb;
+#endif
+	return proc;
+}
+
+static void mm_proc_free(struct pcb_t * proc) {
+	free_mm(proc->mm);
+	free(proc);
+}
+
+/* __alloc() of one page into every region slot then __free() of all of
+ * them, on a fresh process and RAM each round */
+static void bench_mm_alloc(void) {
+	struct memphy_struct ram, swp;
+	struct bench_lat alat, flat;
+	uint64_t at = 0, ft = 0, b;
+	long ops = 0;
+	int r, i, addr;
+
+	memset(&swp, 0, sizeof(swp));
+	init_memphy(&swp, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	lat_init(&alat, BENCH_MM_ROUNDS);
+	lat_init(&flat, BENCH_MM_ROUNDS);
+	for (r = 0; r < BENCH_MM_ROUNDS; r++) {
+		struct pcb_t * proc;
+
+		memset(&ram, 0, sizeof(ram));
+		init_memphy(&ram, 2 * PAGING_MAX_SYMTBL_SZ * PAGING_PAGESZ, 1);
+		proc = mm_proc(&ram, &swp, NULL);
+
+		b = now_ns();
+		for (i = 0; i < PAGING_MAX_SYMTBL_SZ; i++)
+			__alloc(proc, 0, i, PAGING_PAGESZ, &addr);
+		b = now_ns() - b;
+		at += b;
+		lat_add(&alat, b, PAGING_MAX_SYMTBL_SZ);
+
+		b = now_ns();
+		for (i = 0; i < PAGING_MAX_SYMTBL_SZ; i++)
+			__free(proc, 0, i);
+		b = now_ns() - b;
+		ft += b;
+		lat_add(&flat, b, PAGING_MAX_SYMTBL_SZ);
+
+		ops += PAGING_MAX_SYMTBL_SZ;
+		mm_proc_free(proc);
+		free_memphy(&ram);
+	}
+	report("mm_alloc", "size=256", ops, at, &alat);
+	report("mm_free", "size=256", ops, ft, &flat);
+	free_memphy(&swp);
+}
+
+/* pg_getval()/pg_setval() over [BENCH_MM_PAGES] resident pages, the
+ * path every READ and WRITE takes on a page table hit */
+static void bench_mm_access(void) {
+	struct memphy_struct ram, swp;
+	struct bench_lat glat, slat;
+	struct pcb_t * proc;
+	uint64_t t0, gt, st, b;
+	long i, j;
+	int addr, size = BENCH_MM_PAGES * PAGING_PAGESZ;
+	BYTE data;
+
+	memset(&ram, 0, sizeof(ram));
+	memset(&swp, 0, sizeof(swp));
+	init_memphy(&ram, 2 * size, 1);
+	init_memphy(&swp, size, 1);
+	proc = mm_proc(&ram, &swp, NULL);
+	__alloc(proc, 0, 0, size, &addr);
+
+	lat_init(&slat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			pg_setval(proc->mm, addr + (j * 97) % size, j, proc);
+		lat_add(&slat, now_ns() - b, BENCH_BATCH);
+	}
+	st = now_ns() - t0;
+
+	lat_init(&glat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			pg_getval(proc->mm, addr + (j * 97) % size, &data, proc);
+		lat_add(&glat, now_ns() - b, BENCH_BATCH);
+	}
+	gt = now_ns() - t0;
+
+	report("mm_setval", "path=hit", i, st, &slat);
+	report("mm_getval", "path=hit", i, gt, &glat);
+
+	mm_proc_free(proc);
+	free_memphy(&ram);
+	free_memphy(&swp);
+}
+
+/* Page copies between RAM and swap, the data movement of one swap, and
+ * the frame exchange doing both directions at once */
+static void bench_mm_swap(void) {
+	struct memphy_struct ram, swp;
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	long i, j;
+
+	memset(&ram, 0, sizeof(ram));
+	memset(&swp, 0, sizeof(swp));
+	init_memphy(&ram, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	init_memphy(&swp, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	memset(ram.storage, 1, ram.maxsz);
+	memset(swp.storage, 2, swp.maxsz);
+
+	lat_init(&lat, BENCH_ITERS / 16);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS / 16; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j += 2) {
+			/* Out to swap, then the other page back in */
+			__swap_cp_page(&ram, j % BENCH_MM_PAGES, &swp, j % BENCH_MM_PAGES);
+			__swap_cp_page(&swp, (j + 1) % BENCH_MM_PAGES,
+				&ram, (j + 1) % BENCH_MM_PAGES);
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	report("mm_swap_copy", "size=256", i, t1 - t0, &lat);
+
+	lat_init(&lat, BENCH_ITERS / 16);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS / 16; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			MEMPHY_exchange_frames(&ram, j % BENCH_MM_PAGES,
+				&swp, (j * 7) % BENCH_MM_PAGES);
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	report("mm_swap_xchg", "size=256", i, t1 - t0, &lat);
+
+	free_memphy(&ram);
+	free_memphy(&swp);
+}
+
+/* Free frame pool of a 16MB device: formatting it, single frame
+ * get/put pairs and [BENCH_FRAME_BATCH] frame batches */
+static void bench_mm_frames(void) {
+	struct memphy_struct swp;
+	struct bench_lat lat, blat, rlat;
+	int fpns[BENCH_FRAME_BATCH];
+	uint64_t t0, ft, st, bt, rt, b;
+	struct mm_struct mm;
+	char params[32];
+	long i, j, k;
+	int fpn;
+
+	memset(&swp, 0, sizeof(swp));
+	t0 = now_ns();
+	init_memphy(&swp, 1 << 24, 1);
+	ft = now_ns() - t0;
+
+	lat_init(&lat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH; j++) {
+			MEMPHY_get_freefp(&swp, &fpn);
+			MEMPHY_put_freefp(&swp, fpn);
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	st = now_ns() - t0;
+
+	lat_init(&blat, BENCH_ITERS / BENCH_FRAME_BATCH);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS / BENCH_FRAME_BATCH; i += BENCH_BATCH / 8) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH / 8; j++) {
+			MEMPHY_get_freefps(&swp, fpns, BENCH_FRAME_BATCH);
+			MEMPHY_put_freefps(&swp, fpns, BENCH_FRAME_BATCH);
+		}
+		lat_add(&blat, now_ns() - b, BENCH_BATCH / 8);
+	}
+	bt = now_ns() - t0;
+
+	/* Every frame holds a page, then all of them are released in an
+	 * order unrelated to the one they were mapped in */
+	for (j = 0; j < swp.nr_frames; j++) {
+		MEMPHY_get_freefp(&swp, &fpn);
+		MEMPHY_map_frame(&swp, fpn, &mm, j, NULL);
+	}
+	lat_init(&rlat, swp.nr_frames);
+	t0 = now_ns();
+	for (k = 0; k + BENCH_BATCH <= swp.nr_frames; k += BENCH_BATCH) {
+		b = now_ns();
+		for (j = k; j < k + BENCH_BATCH; j++)
+			MEMPHY_free_frame(&swp, (j * 7919) % swp.nr_frames);
+		lat_add(&rlat, now_ns() - b, BENCH_BATCH);
+	}
+	rt = now_ns() - t0;
+
+	printf("bench=mm_format dev=16M frames=%d ns=%llu\n", swp.nr_frames,
+		(unsigned long long)ft);
+	report("mm_frame_getput", "", BENCH_ITERS, st, &lat);
+	snprintf(params, sizeof(params), "batch=%d", BENCH_FRAME_BATCH);
+	report("mm_frame_batch", params, i, bt, &blat);
+	report("mm_frame_release", "", k, rt, &rlat);
+
+	free_memphy(&swp);
+}
+
+/* Victim selection of each replacement policy over a full RAM of
+ * [BENCH_MM_PAGES] frames, half of whose pages are referenced again
+ * between evictions. The victim's frame is mapped back as the newest */
+static void bench_mm_policy(const struct pg_policy * policy) {
+	struct memphy_struct ram;
+	struct pcb_t * proc;
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	char params[32];
+	long i, j;
+	int fpn;
+
+	memset(&ram, 0, sizeof(ram));
+	init_memphy(&ram, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	proc = mm_proc(&ram, NULL, NULL);
+	for (j = 0; j < BENCH_MM_PAGES; j++) {
+		MEMPHY_get_freefp(&ram, &fpn);
+		pte_set_fpn(&proc->mm->pgd[j], fpn);
+		MEMPHY_map_frame(&ram, fpn, proc->mm, j, proc);
+	}
+
+	lat_init(&lat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++) {
+			SETBIT(proc->mm->pgd[(j * 2) % BENCH_MM_PAGES],
+				PAGING_PTE_REFERENCED_MASK);
+			fpn = policy->find_victim(&ram);
+			MEMPHY_map_frame(&ram, fpn, proc->mm,
+				ram.frames[fpn].pgn, proc);
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	snprintf(params, sizeof(params), "policy=%s frames=%d",
+		policy->name, BENCH_MM_PAGES);
+	report("mm_victim", params, i, t1 - t0, &lat);
+
+	mm_proc_free(proc);
+	free_memphy(&ram);
+}
+
+/* swap_out_page() of online pages that already have a swap copy, the
+ * clean ones skip the write back the dirty ones need */
+static void bench_mm_swapout(int dirty) {
+	struct memphy_struct ram, swp;
+	struct framephy_struct vic;
+	struct pcb_t * proc;
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	long i, j;
+	int fpn, swpfpn;
+
+	memset(&ram, 0, sizeof(ram));
+	memset(&swp, 0, sizeof(swp));
+	init_memphy(&ram, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	init_memphy(&swp, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	proc = mm_proc(&ram, &swp, NULL);
+	for (j = 0; j < BENCH_MM_PAGES; j++) {
+		MEMPHY_get_freefp(&ram, &fpn);
+		MEMPHY_get_freefp(&swp, &swpfpn);
+		pte_set_fpn(&proc->mm->pgd[j], fpn);
+		MEMPHY_map_frame(&ram, fpn, proc->mm, j, proc);
+		ram.frames[fpn].swpfpn = swpfpn;
+	}
+
+	lat_init(&lat, BENCH_ITERS / 16);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS / 16; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++) {
+			vic.id = j % BENCH_MM_PAGES;
+			vic.fpn = vic.id;
+			vic.owner = proc->mm;
+			vic.p_owner = proc;
+			if (dirty)
+				SETBIT(proc->mm->pgd[vic.id], PAGING_PTE_DIRTY_MASK);
+			swap_out_page(proc, &vic, &swpfpn);
+			/* Straight back in, over the same copy */
+			pte_set_fpn(&proc->mm->pgd[vic.id], vic.fpn);
+			MEMPHY_map_frame(&ram, vic.fpn, proc->mm, vic.id, proc);
+			ram.frames[vic.fpn].swpfpn = swpfpn;
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	report("mm_swapout", dirty ? "page=dirty" : "page=clean", i, t1 - t0, &lat);
+
+	mm_proc_free(proc);
+	free_memphy(&ram);
+	free_memphy(&swp);
+}
+
+/* Page copies from RAM out to scattered frames of a sequential swap
+ * device, whose head has to seek between them */
+static void bench_mm_seq(void) {
+	struct memphy_struct ram, swp;
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	char params[64];
+	int nr_frames;
+	long i, j;
+
+	memset(&ram, 0, sizeof(ram));
+	memset(&swp, 0, sizeof(swp));
+	init_memphy(&ram, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	init_memphy(&swp, 1 << 24, 0);
+	nr_frames = MEMPHY_NR_FRAMES(&swp);
+
+	lat_init(&lat, BENCH_ITERS / 16);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS / 16; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			__swap_cp_page(&ram, j % BENCH_MM_PAGES,
+				&swp, (j * 7919) % nr_frames);
+		lat_add(&lat, now_ns() - b, BENCH_BATCH);
+	}
+	t1 = now_ns();
+	snprintf(params, sizeof(params), "size=256 dev=16M seek_cost_per_op=%lu",
+		swp.seek_cost / i);
+	report("mm_seq_copy", params, i, t1 - t0, &lat);
+
+	free_memphy(&ram);
+	free_memphy(&swp);
+}
+
+/* MEMPHY_dump() of a 1MB RAM after a write to each of [BENCH_MM_PAGES]
+ * frames, as a dump only shows the frames written since the one before.
+ * Dumps go into a trace buffer that is emptied after each of them */
+static void bench_mm_dump(void) {
+	struct memphy_struct ram;
+	struct trace_buf buf = { NULL, 0, 0 };
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	char params[48];
+	long i, j, k;
+
+	memset(&ram, 0, sizeof(ram));
+	init_memphy(&ram, 1 << 20, 1);
+	trace_bind(&bench_trace, &buf, NULL, -1);
+
+	lat_init(&lat, BENCH_MM_ROUNDS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_MM_ROUNDS; i += BENCH_BATCH / 8) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH / 8; j++) {
+			for (k = 0; k < BENCH_MM_PAGES; k++)
+				MEMPHY_write(&ram, k * 7 * PAGING_PAGESZ + k, k + 1);
+			MEMPHY_dump(&ram);
+			buf.len = 0;
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH / 8);
+	}
+	t1 = now_ns();
+	snprintf(params, sizeof(params), "size=1M touched=%d", BENCH_MM_PAGES);
+	report("mm_dump", params, i, t1 - t0, &lat);
+
+	trace_bind(&bench_trace, NULL, NULL, -1);
+	trace_free(&buf);
+	free_memphy(&ram);
+}
+#endif
+
+#ifdef CPU_TLB
+/* tlb_cache_write() filling, then tlb_cache_read() hitting, the entries
+ * of [BENCH_MM_PAGES] pages */
+static void bench_tlb(void) {
+	struct memphy_struct ram, swp, tlb;
+	struct bench_lat wlat, rlat;
+	struct pcb_t * proc;
+	uint64_t t0, wt, rt, b;
+	long i, j;
+	int addr;
+
+	memset(&ram, 0, sizeof(ram));
+	memset(&swp, 0, sizeof(swp));
+	memset(&tlb, 0, sizeof(tlb));
+	init_memphy(&ram, 2 * BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	init_memphy(&swp, BENCH_MM_PAGES * PAGING_PAGESZ, 1);
+	init_tlbmemphy(&tlb, 0x10000);
+	proc = mm_proc(&ram, &swp, &tlb);
+	__alloc(proc, 0, 0, BENCH_MM_PAGES * PAGING_PAGESZ, &addr);
+
+	lat_init(&wlat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			tlb_cache_write(&tlb, proc, j % BENCH_MM_PAGES);
+		lat_add(&wlat, now_ns() - b, BENCH_BATCH);
+	}
+	wt = now_ns() - t0;
+
+	lat_init(&rlat, BENCH_ITERS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_ITERS; i += BENCH_BATCH) {
+		b = now_ns();
+		for (j = i; j < i + BENCH_BATCH; j++)
+			tlb_cache_read(&tlb, proc->pid, j % BENCH_MM_PAGES, 0);
+		lat_add(&rlat, now_ns() - b, BENCH_BATCH);
+	}
+	rt = now_ns() - t0;
+
+	report("tlb_write", "", i, wt, &wlat);
+	report("tlb_read", "path=hit", i, rt, &rlat);
+
+	mm_proc_free(proc);
+	free_memphy(&ram);
+	free_memphy(&swp);
+	free_memphy(&tlb);
+}
+#endif
+
+/* Write a [BENCH_PROG_SIZE] instruction program to a temporary file,
+ * compiled or as text. Return its path, to be unlinked by the caller */
+static char * bench_program(int compiled) {
+	static const char * const text[] = {
+		"calc", "alloc 300 0", "write 100 0 20", "read 0 20 1", "free 0"
+	};
+	char * path = strdup("/tmp/bench-prog-XXXXXX");
+	struct prog_header hdr;
+	struct inst_t inst;
+	FILE * file;
+	int i;
+
+	file = fdopen(mkstemp(path), "w");
+	if (compiled) {
+		hdr.magic = PROG_MAGIC;
+		hdr.version = PROG_VERSION;
+		hdr.priority = 1;
+		hdr.size = BENCH_PROG_SIZE;
+		fwrite(&hdr, sizeof(hdr), 1, file);
+		memset(&inst, 0, sizeof(inst));
+		for (i = 0; i < BENCH_PROG_SIZE; i++) {
+			inst.opcode = i % 5;
+			fwrite(&inst, sizeof(inst), 1, file);
+		}
+	} else {
+		fprintf(file, "1 %d\n", BENCH_PROG_SIZE);
+		for (i = 0; i < BENCH_PROG_SIZE; i++)
+			fprintf(file, "%s\n", text[i % 5]);
+	}
+	fclose(file);
+	return path;
+}
+
+/* load() without a program cache, so every call reads the file */
+static void bench_load(int compiled) {
+	char * path = bench_program(compiled);
+	struct bench_lat lat;
+	uint64_t t0, t1, b;
+	char params[32];
+	long i, j;
+
+	lat_init(&lat, BENCH_LOADS);
+	t0 = now_ns();
+	for (i = 0; i < BENCH_LOADS; i += BENCH_BATCH / 8) {
+		b = now_ns();
+		for (j = 0; j < BENCH_BATCH / 8; j++) {
+			struct pcb_t * proc = load(NULL, path, 1);
+			release_code(proc->code);
+			free(proc->page_table);
+			free(proc);
+		}
+		lat_add(&lat, now_ns() - b, BENCH_BATCH / 8);
+	}
+	t1 = now_ns();
+	snprintf(params, sizeof(params), "insts=%d", BENCH_PROG_SIZE);
+	report(compiled ? "load_compiled" : "load_text", params, i, t1 - t0, &lat);
+
+	unlink(path);
+	free(path);
+}
+
+int main(int argc, char * argv[]) {
+	int cpus[] = { 1, 8, 64 };
+	uint32_t prios[] = { 0, MAX_PRIO - 1 };
+	unsigned int c, p;
+
+	bench_argc = argc - 1;
+	bench_argv = argv + 1;
+	trace_ctx_init(&bench_trace, TRACE_NONE, NULL);
+	trace_bind(&bench_trace, NULL, NULL, -1);
+
+	if (selected("queue"))
+		bench_queue();
+	if (selected("dispatch"))
+		for (p = 0; p < sizeof(prios) / sizeof(prios[0]); p++)
+			for (c = 0; c < sizeof(cpus) / sizeof(cpus[0]); c++)
+				bench_dispatch(cpus[c], prios[p]);
+	if (selected("admit"))
+		for (c = 0; c < sizeof(cpus) / sizeof(cpus[0]); c++)
+			bench_admit(cpus[c]);
+	if (selected("slots"))
+		for (c = 0; c < sizeof(cpus) / sizeof(cpus[0]); c++)
+			bench_slots(cpus[c]);
+#ifdef MM_PAGING
+	if (selected("mm_alloc") || selected("mm_free"))
+		bench_mm_alloc();
+	if (selected("mm_setval") || selected("mm_getval"))
+		bench_mm_access();
+	if (selected("mm_swap_copy") || selected("mm_swap_xchg"))
+		bench_mm_swap();
+	if (selected("mm_format") || selected("mm_frame_getput") ||
+			selected("mm_frame_batch") || selected("mm_frame_release"))
+		bench_mm_frames();
+	if (selected("mm_victim")) {
+		bench_mm_policy(&pg_policy_fifo);
+		bench_mm_policy(&pg_policy_clock);
+		bench_mm_policy(&pg_policy_aging);
+	}
+	if (selected("mm_swapout")) {
+		bench_mm_swapout(0);
+		bench_mm_swapout(1);
+	}
+	if (selected("mm_seq_copy"))
+		bench_mm_seq();
+	if (selected("mm_dump"))
+		bench_mm_dump();
+#endif
+#ifdef CPU_TLB
+	if (selected("tlb_write") || selected("tlb_read"))
+		bench_tlb();
+#endif
+	if (selected("load_text"))
+		bench_load(0);
+	if (selected("load_compiled"))
+		bench_load(1);
+
+	return 0;
+}
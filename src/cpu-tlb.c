@@ -14,12 +14,11 @@
  
 #include "mm.h"
 #include "os-mm.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 
-static pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER;
-
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp)
 {
   /* TODO update all page table directory info 
@@ -65,14 +64,11 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
     pgn++;
   }
 
-#ifdef IODUMP
-
-  printf("TLB after alloc: , PID: %d, size: %d, reg_index: %d \n", proc->pid, size, reg_index);
-  TLBMEMPHY_bin_dump(proc->tlb);
-#ifdef PAGETBL_DUMP
-  print_pgtbl(proc, 0, -1); //print max TBL
-#endif
-#endif
+  trace(TRACE_IO, "TLB after alloc: , PID: %d, size: %d, reg_index: %d \n", proc->pid, size, reg_index);
+  if (trace_on(TRACE_DUMP)) {
+    TLBMEMPHY_bin_dump(proc->tlb);
+    print_pgtbl(proc, 0, -1); //print max TBL
+  }
   return 0;
 }
 
@@ -121,6 +117,7 @@ int tlbread(struct pcb_t * proc, uint32_t source,
   /* frmnum is return value of tlb_cache_read/write value*/
   // DONE
   struct vm_rg_struct *currg = get_symrg_byid(proc->mm, source);
+  if (currg == NULL) return -1;
   int addr = currg->rg_start + offset;
   int pgn = PAGING_PGN(addr);
 
@@ -128,28 +125,28 @@ int tlbread(struct pcb_t * proc, uint32_t source,
   if(val == -1) return -1;
   frmnum = tlb_cache_read(proc->tlb, proc->pid, pgn, data);
 
-#ifdef IODUMP
   if (frmnum >= 0) {
-    printf("\tTLB hit at read region=%d offset=%d, Read value = %d\n", 
+    trace(TRACE_IO, "\tTLB hit at read region=%d offset=%d, Read value = %d\n", 
 	         source, offset, data);
-    pthread_mutex_lock(&vm_lock);
+    trace_ev(EV_TLBHIT, proc->pid, source, offset);
+    pthread_mutex_lock(&proc->mram->lock);
     proc->stat_hit_time++;
-    pthread_mutex_unlock(&vm_lock);
+    pthread_mutex_unlock(&proc->mram->lock);
   }
   else {
-    printf("\tTLB miss at read region=%d offset=%d\n", 
+    trace(TRACE_IO, "\tTLB miss at read region=%d offset=%d\n", 
 	         source, offset);
-    pthread_mutex_lock(&vm_lock);
+    trace_ev(EV_TLBMISS, proc->pid, source, offset);
+    pthread_mutex_lock(&proc->mram->lock);
     proc->stat_miss_time++;
-    pthread_mutex_unlock(&vm_lock);
+    pthread_mutex_unlock(&proc->mram->lock);
     // tlb_cache_write(proc->tlb, proc, pgn);
   }
   
-#ifdef PAGETBL_DUMP
-  print_pgtbl(proc, 0, -1); //print max TBL
-#endif
-  MEMPHY_dump(proc->mram);
-#endif
+  if (trace_on(TRACE_DUMP)) {
+    print_pgtbl(proc, 0, -1); //print max TBL
+    MEMPHY_dump(proc->mram);
+  }
 
   destination = (uint32_t) data;
 
@@ -175,39 +172,38 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
   frmnum is return value of tlb_cache_read/write value*/ // DONE
 
   struct vm_rg_struct *currg = get_symrg_byid(proc->mm, destination);
+  if (currg == NULL) return -1;
   int addr = currg->rg_start + offset;
   int pgn = PAGING_PGN(addr);
 
   frmnum = tlb_cache_read(proc->tlb, proc->pid, pgn, data);
-  val = __write(proc, 0, proc->pid, offset, data);
+  val = __write(proc, 0, destination, offset, data);
 
   if (val == -1) return -1;
 
-#ifdef IODUMP
   if (frmnum >= 0)
   {
-    printf("TLB hit at write region=%d offset=%d value=%d\n",
+    trace(TRACE_IO, "TLB hit at write region=%d offset=%d value=%d\n",
 	          destination, offset, data);
-    pthread_mutex_lock(&vm_lock);
+    trace_ev(EV_TLBHIT, proc->pid, destination, offset);
+    pthread_mutex_lock(&proc->mram->lock);
     proc->stat_hit_time++;
-    pthread_mutex_unlock(&vm_lock);
+    pthread_mutex_unlock(&proc->mram->lock);
   }
 	else
   {
-    printf("TLB miss at write region=%d offset=%d value=%d\n",
+    trace(TRACE_IO, "TLB miss at write region=%d offset=%d value=%d\n",
             destination, offset, data);
-    pthread_mutex_lock(&vm_lock);
+    trace_ev(EV_TLBMISS, proc->pid, destination, offset);
+    pthread_mutex_lock(&proc->mram->lock);
     proc->stat_miss_time++;
-    pthread_mutex_unlock(&vm_lock);
+    pthread_mutex_unlock(&proc->mram->lock);
     tlb_cache_write(proc->tlb, proc, pgn);
   }
-#ifdef PAGETBL_DUMP
-  print_pgtbl(proc, 0, -1); //print max TBL
-#endif
-  MEMPHY_dump(proc->mram);
-#endif
-
-  val = __write(proc, 0, destination, offset, data);
+  if (trace_on(TRACE_DUMP)) {
+    print_pgtbl(proc, 0, -1); //print max TBL
+    MEMPHY_dump(proc->mram);
+  }
 
   /* TODO update TLB CACHED with frame num of recent accessing page(s)*/
   /* by using tlb_cache_read()/tlb_cache_write()*/
@@ -18,13 +18,12 @@
 
 
 #include "mm.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
 
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
-
 void printBits(unsigned int v) {
    unsigned int cv = v;
    char bit[33];
@@ -35,7 +34,7 @@ void printBits(unsigned int v) {
       mask = (mask >> 1);
    }
    bit[32] = '\0';
-   printf("(%u) %s\n",cv ,bit );
+   trace_printf("(%u) %s\n",cv ,bit );
 }
 
 
@@ -50,12 +49,10 @@ void printBits(unsigned int v) {
  */
 
 void init_tlb_entry(BYTE *tlb, int valid, int pid, int pg_num, int frm_num) {
-    pthread_mutex_lock(&cache_lock);
     *tlb = (valid & 0x1) << 31;               // 1 bit valid
     *tlb |= (pid & 0x1F) << 26;               // 5 bit pid
     *tlb |= (pg_num & 0x3FFF) << 12;          // 14 bit page number
     *tlb |= (frm_num & 0xFFF);  	      // 12 bit frame number
-    pthread_mutex_unlock(&cache_lock);
 }
 
 // Get Valid from TLB entry
@@ -114,7 +111,7 @@ int tlb_cache_read(struct memphy_struct * mp, int pid, int pgnum, BYTE value)
          if(PAGING_PAGE_PRESENT(pte)) {
             TLBMEMPHY_write(mp, phy_adr, ((wvalue[i] >> 24) | 64)); // Set LRU of this block to 1
             TLBMEMPHY_write(mp, phy_adr + (i==0?8:-8), ((wvalue[1-i] >> 24) & 95 )); // Set LRU of other block to 0 
-            return PAGING_FPN(pte);
+            return PAGING_PTE_FPN(pte);
          }
       }
    }
@@ -167,7 +164,7 @@ int tlb_cache_write(struct memphy_struct *mp, struct pcb_t* proc, int pgnum)
          unsigned int pte = proc->mm->pgd[pgnum];
          TLBMEMPHY_write_word(mp,phy_adr+4,pte);
 
-         return PAGING_FPN(pte);
+         return PAGING_PTE_FPN(pte);
       }
    }
 
@@ -191,7 +188,7 @@ int tlb_cache_write(struct memphy_struct *mp, struct pcb_t* proc, int pgnum)
          unsigned int pte = proc->mm->pgd[pgnum];
          TLBMEMPHY_write_word(mp,phy_adr+4,pte);
 
-         return PAGING_FPN(pte);
+         return PAGING_PTE_FPN(pte);
       }
    }
 
@@ -238,14 +235,16 @@ int tlb_cache_set_invalid(struct memphy_struct *mp, struct pcb_t* proc, int pgnu
 
 unsigned int TLBMEMPHY_read_word(struct memphy_struct * mp, int addr) {
    unsigned int val = 0;
-   for(int i=0; i<4; i++) {
-      BYTE value;
-      if( TLBMEMPHY_read(mp, addr+i, &value) == -1) {
-         perror("Cache reading error!");
-         return -1;
-      }
-      val = (val<<8) + (int)value;
+   BYTE bytes[4];
+
+   if (MEMPHY_read_bytes(mp, addr, bytes, 4) == -1) {
+      perror("Cache reading error!");
+      return -1;
    }
+   /* Most significant byte first, each added as the (signed) BYTE the
+    * entry layout has always been decoded with */
+   for (int i = 0; i < 4; i++)
+      val = (val << 8) + (int)bytes[i];
    return val;
 }
 
@@ -261,20 +260,13 @@ int TLBMEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value)
 }
 
 unsigned int TLBMEMPHY_write_word(struct memphy_struct * mp, int addr, unsigned int data) {
-   //printf("DAT %u", data);
-   unsigned int val = 0;
-   unsigned int mask = 0b11111111;
-   for(int i=3; i>=0; i--) {
-      unsigned char value = (unsigned char)((data & mask)%256);
-      //printf("BIT TEST %c, %u, %u - ", value, data, mask);
-      //printBits((unsigned int)value);
-      if( TLBMEMPHY_write(mp, addr+i, value) == -1) {
-         perror("Cache writing error!");
-         return -1;
-      }
-      data = (data >> 8);
+   BYTE bytes[4] = { data >> 24, data >> 16, data >> 8, data };
+
+   if (MEMPHY_write_bytes(mp, addr, bytes, 4) == -1) {
+      perror("Cache writing error!");
+      return -1;
    }
-   return val;
+   return 0;
 }
 /*
  *  TLBMEMPHY_write natively supports MEMPHY device interfaces
@@ -289,6 +281,7 @@ int TLBMEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
 
    /* TLB cached is random access by native */
    mp->storage[addr] = data;
+   MEMPHY_touch(mp, addr);
 
    return 0;
 }
@@ -299,6 +292,10 @@ int TLBMEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
  */
 
 
+/*
+ *  TLBMEMPHY_dump - like MEMPHY_dump, covers the frames written since
+ *  the previous dump of the cache
+ */
 int TLBMEMPHY_dump(struct memphy_struct * mp)
 {
    /*TODO dump memphy contnt mp->storage 
@@ -309,23 +306,27 @@ int TLBMEMPHY_dump(struct memphy_struct * mp)
    fprintf(output_file, "===== PHYSICAL MEMORY DUMP (TLB CACHE) =====\n");
 #endif
 
-   printf("\t\tPHYSICAL MEMORY (TLB CACHE) DUMP :\n");
-   for (int i = 0; i < mp->maxsz; ++i)
+   trace_printf("\t\tPHYSICAL MEMORY (TLB CACHE) DUMP :\n");
+   pthread_mutex_lock(&mp->lock);
+   MEMPHY_take_touched(mp);
+   for (int i = MEMPHY_next_touched(mp, 0); i < mp->maxsz;
+        i = MEMPHY_next_touched(mp, i + 1))
    {
       if (mp->storage[i] != 0)
       {
 #ifdef OUTPUT_FOLDER
          fprintf(output_file, "BYTE %08x: %d\n", i, mp->storage[i]);
 #endif
-         printf("BYTE %08x: %d\n", i, mp->storage[i]);
+         trace_printf("BYTE %08x: %d\n", i, mp->storage[i]);
       }
    }
+   pthread_mutex_unlock(&mp->lock);
 #ifdef OUTPUT_FOLDER
    fprintf(output_file, "===== PHYSICAL MEMORY END-DUMP (TLB CACHE)=====\n");
    fprintf(output_file, "================================================================\n");
 #endif
 
-   printf("\t\tPHYSICAL MEMORY END-DUMP\n");
+   trace_printf("\t\tPHYSICAL MEMORY END-DUMP\n");
    return 0;
 }
 
@@ -335,20 +336,24 @@ int TLBMEMPHY_bin_dump(struct memphy_struct * mp)
     *     for tracing the memory content
     */
 
-   printf("\t*** PHYSICAL MEMORY (TLB CACHE) BIN DUMP:\n");
-   for (int i = 0; i < mp->maxsz; i+=4)
+   trace_printf("\t*** PHYSICAL MEMORY (TLB CACHE) BIN DUMP:\n");
+   pthread_mutex_lock(&mp->lock);
+   MEMPHY_take_touched(mp);
+   for (int i = MEMPHY_next_touched(mp, 0); i < mp->maxsz;
+        i = MEMPHY_next_touched(mp, i + 4))
    {
       if (mp->storage[i] != 0)
       {
 #ifdef OUTPUT_FOLDER
          fprintf(output_file, "BYTE %08x: %d\n", i, mp->storage[i]);
 #endif
-         printf("\t   (%d) %08x: ",i, i);
+         trace_printf("\t   (%d) %08x: ",i, i);
          printBits(TLBMEMPHY_read_word(mp, i));
       }
    }
+   pthread_mutex_unlock(&mp->lock);
 
-   printf("\t*** PHYSICAL MEMORY END-DUMP\n");
+   trace_printf("\t*** PHYSICAL MEMORY END-DUMP\n");
    return 0;
 }
 
@@ -359,10 +364,15 @@ int TLBMEMPHY_bin_dump(struct memphy_struct * mp)
  */
 int init_tlbmemphy(struct memphy_struct *mp, int max_size)
 {
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
+   mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
    mp->maxsz = max_size;
+   mp->touched = calloc(BITS_TO_LONGS(MEMPHY_NR_FRAMES(mp)),
+                        sizeof(unsigned long));
+   mp->dumping = calloc(BITS_TO_LONGS(MEMPHY_NR_FRAMES(mp)),
+                        sizeof(unsigned long));
 
    mp->rdmflg = 1;
+   pthread_mutex_init(&mp->lock, NULL);
 
    return 0;
 }
@@ -2,6 +2,7 @@
 #include "cpu.h"
 #include "mem.h"
 #include "mm.h"
+#include "trace.h"
 
 int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -63,17 +64,19 @@ int run(struct pcb_t * proc) {
 		stat = tlballoc(proc, ins.arg_0, ins.arg_1);
 #elif defined(MM_PAGING)
 		stat = pgalloc(proc, ins.arg_0, ins.arg_1);
-		print_pgtbl(proc, 0, -1);
-		MEMPHY_dump(proc->mram);
+		if (trace_on(TRACE_DUMP)) {
+			print_pgtbl(proc, 0, -1);
+			MEMPHY_dump(proc->mram);
+		}
 #endif
 		break;
 	case FREE:
 #ifdef CPU_TLB
 		stat = tlbfree_data(proc, ins.arg_0);
-		printf("\tProcess %d free region %d\n", proc->pid, ins.arg_0);
+		trace(TRACE_IO, "\tProcess %d free region %d\n", proc->pid, ins.arg_0);
 #elif defined(MM_PAGING)
 		stat = pgfree_data(proc, ins.arg_0);
-		printf("process %d free region %d\n\n", proc->pid, ins.arg_0);
+		trace(TRACE_IO, "process %d free region %d\n\n", proc->pid, ins.arg_0);
 #else
 		stat = free_data(proc, ins.arg_0);
 #endif
@@ -1,10 +1,12 @@
 
 #include "loader.h"
+#include "trace.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-static uint32_t avail_pid = 1;
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define OPT_CALC	"calc"
 #define OPT_ALLOC	"alloc"
@@ -12,7 +14,8 @@ static uint32_t avail_pid = 1;
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
 
-static enum ins_opcode_t get_opcode(char * opt) {
+/* Opcode named [opt], -1 if there is none */
+static int get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
 		return CALC;
 	}else if (!strcmp(opt, OPT_ALLOC)) {
@@ -24,68 +27,264 @@ static enum ins_opcode_t get_opcode(char * opt) {
 	}else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
 	}else{
-		printf("Opcode: %s\n", opt);
-		exit(1);
+		return -1;
 	}
 }
 
-struct pcb_t * load(const char * path) {
-	/* Create new PCB for the new process */
-	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
-	proc->page_table =
-		(struct page_table_t*)malloc(sizeof(struct page_table_t));
-	proc->bp = PAGE_SIZE;
-	proc->pc = 0;
-
-	/* Read process code from file */
-	FILE * file;
-	if ((file = fopen(path, "r")) == NULL) {
-		printf("Cannot find process description at '%s'\n", path);
-		exit(1);		
-	}
+/* Parse a text program. A header claiming more instructions than the
+ * file holds is cut down to the ones actually there. Return -1 if the
+ * header is missing or an opcode is unknown */
+static int load_text(FILE * file, struct code_seg_t * code,
+		uint32_t * priority) {
 	char opcode[10];
-	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
-	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
-	proc->code->text = (struct inst_t*)malloc(
-		sizeof(struct inst_t) * proc->code->size
+	if (fscanf(file, "%u %u", priority, &code->size) != 2) {
+		fprintf(trace_stream(trace_ctx_cur), "No program header\n");
+		code->size = 0;
+		return -1;
+	}
+	/* Zeroed, so arguments an opcode does not take are well defined */
+	code->text = (struct inst_t*)calloc(
+		code->size, sizeof(struct inst_t)
 	);
 	uint32_t i = 0;
-	for (i = 0; i < proc->code->size; i++) {
-		fscanf(file, "%s", opcode);
-		proc->code->text[i].opcode = get_opcode(opcode);
-		switch(proc->code->text[i].opcode) {
+	for (i = 0; i < code->size; i++) {
+		if (fscanf(file, "%9s", opcode) != 1) {
+			code->size = i;
+			break;
+		}
+		int op = get_opcode(opcode);
+		if (op < 0) {
+			fprintf(trace_stream(trace_ctx_cur), "Opcode: %s\n", opcode);
+			code->size = i;
+			return -1;
+		}
+		code->text[i].opcode = op;
+		switch(code->text[i].opcode) {
 		case CALC:
 			break;
 		case ALLOC:
 			fscanf(
 				file,
 				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
+				&code->text[i].arg_0,
+				&code->text[i].arg_1
 			);
 			break;
 		case FREE:
-			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			fscanf(file, "%u\n", &code->text[i].arg_0);
 			break;
 		case READ:
 		case WRITE:
 			fscanf(
 				file,
 				"%u %u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1,
-				&proc->code->text[i].arg_2
+				&code->text[i].arg_0,
+				&code->text[i].arg_1,
+				&code->text[i].arg_2
 			);
 			break;	
 		default:
-			printf("Opcode: %s\n", opcode);
-			exit(1);
+			break;
 		}
 	}
-	return proc;
+	return 0;
+}
+
+/* Map a compiled program, code->text then points straight into the
+ * mapping. Return -1 if [file] is not a valid compiled program */
+static int load_binary(FILE * file, struct code_seg_t * code,
+		uint32_t * priority) {
+	struct prog_header * hdr;
+	struct stat st;
+
+	if (fstat(fileno(file), &st) < 0 || st.st_size < (off_t)sizeof(*hdr))
+		return -1;
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+	if (hdr->magic != PROG_MAGIC || hdr->version != PROG_VERSION ||
+			(st.st_size - sizeof(*hdr)) / sizeof(struct inst_t) < hdr->size) {
+		munmap(hdr, st.st_size);
+		return -1;
+	}
+
+	*priority = hdr->priority;
+	code->size = hdr->size;
+	code->text = (struct inst_t *)(hdr + 1);
+	code->map = hdr;
+	code->map_size = st.st_size;
+	return 0;
+}
+
+/* Read the program at [path] into a new code segment holding one
+ * reference, NULL if it is missing or malformed */
+static struct code_seg_t * read_program(const char * path, uint32_t * priority) {
+	struct code_seg_t * code;
+	FILE * file;
+	uint32_t magic;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(trace_stream(trace_ctx_cur),
+			"Cannot find process description at '%s'\n", path);
+		return NULL;
+	}
+	code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
+	code->text = NULL;
+	code->map = NULL;
+	code->map_size = 0;
+	code->refcnt = 1;
+
+	/* Compiled programs start with PROG_MAGIC, anything else is text */
+	int ret;
+	if (fread(&magic, sizeof(magic), 1, file) == 1 && magic == PROG_MAGIC) {
+		ret = load_binary(file, code, priority);
+		if (ret < 0)
+			fprintf(trace_stream(trace_ctx_cur),
+				"Invalid compiled program at '%s'\n", path);
+	} else {
+		rewind(file);
+		ret = load_text(file, code, priority);
+		if (ret < 0)
+			fprintf(trace_stream(trace_ctx_cur),
+				"Invalid program at '%s'\n", path);
+	}
+	fclose(file);
+	if (ret < 0) {
+		release_code(code);
+		return NULL;
+	}
+	return code;
+}
+
+/*
+ * Program cache: every program file is read once per simulation, the
+ * processes running it share its code segment. Entries hold their own
+ * reference, so a segment lives until the cache is freed.
+ */
+#define PROG_CACHE_BITS	6
+#define PROG_CACHE_SIZE	(1 << PROG_CACHE_BITS)
+
+struct prog_entry {
+	char * path;
+	uint32_t priority;
+	struct code_seg_t * code;
+	struct prog_entry * next;
+};
+
+struct prog_cache {
+	pthread_mutex_t lock;
+	struct prog_entry * bucket[PROG_CACHE_SIZE];
+};
+
+/* FNV-1a */
+static uint32_t hash_path(const char * path) {
+	uint32_t h = 2166136261u;
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h & (PROG_CACHE_SIZE - 1);
+}
+
+/* Find [path] and take a reference on its code. Caller holds the lock */
+static struct code_seg_t * cache_lookup(struct prog_cache * cache,
+		const char * path, uint32_t * priority) {
+	struct prog_entry * entry;
+
+	for (entry = cache->bucket[hash_path(path)]; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			*priority = entry->priority;
+			__atomic_add_fetch(&entry->code->refcnt, 1, __ATOMIC_RELAXED);
+			return entry->code;
+		}
+	}
+	return NULL;
+}
+
+struct prog_cache * init_prog_cache(void) {
+	struct prog_cache * cache = calloc(1, sizeof(struct prog_cache));
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void free_prog_cache(struct prog_cache * cache) {
+	struct prog_entry * entry;
+	int i;
+
+	for (i = 0; i < PROG_CACHE_SIZE; i++) {
+		while ((entry = cache->bucket[i]) != NULL) {
+			cache->bucket[i] = entry->next;
+			release_code(entry->code);
+			free(entry->path);
+			free(entry);
+		}
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
 }
 
+/* Code of the program at [path], read it only on a cache miss */
+static struct code_seg_t * get_program(struct prog_cache * cache,
+		const char * path, uint32_t * priority) {
+	struct prog_entry * entry;
+	struct code_seg_t * code;
 
+	if (cache == NULL)
+		return read_program(path, priority);
 
+	pthread_mutex_lock(&cache->lock);
+	code = cache_lookup(cache, path, priority);
+	pthread_mutex_unlock(&cache->lock);
+	if (code != NULL)
+		return code;
+
+	/* Parse unlocked, another loader may have raced us meanwhile */
+	code = read_program(path, priority);
+	if (code == NULL)
+		return NULL;
+	pthread_mutex_lock(&cache->lock);
+	struct code_seg_t * cached = cache_lookup(cache, path, priority);
+	if (cached != NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		release_code(code);
+		return cached;
+	}
+	entry = malloc(sizeof(struct prog_entry));
+	entry->path = strdup(path);
+	entry->priority = *priority;
+	entry->code = code;
+	code->refcnt++;		/* The entry's reference */
+	entry->next = cache->bucket[hash_path(path)];
+	cache->bucket[hash_path(path)] = entry;
+	pthread_mutex_unlock(&cache->lock);
+	return code;
+}
+
+void release_code(struct code_seg_t * code) {
+	if (__atomic_sub_fetch(&code->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (code->map != NULL)
+		munmap(code->map, code->map_size);
+	else
+		free(code->text);
+	free(code);
+}
+
+struct pcb_t * load(struct prog_cache * cache, const char * path, uint32_t pid) {
+	/* Create new PCB for the new process */
+	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	proc->pid = pid;
+	proc->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	proc->bp = PAGE_SIZE;
+	proc->pc = 0;
+
+	/* Read process code from file */
+	proc->code = get_program(cache, path, &proc->priority);
+	if (proc->code == NULL) {
+		free(proc->page_table);
+		free(proc);
+		return NULL;
+	}
+	return proc;
+}
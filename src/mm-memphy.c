@@ -5,24 +5,33 @@
  */
 
 #include "mm.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
  *  @mp: memphy struct
  *  @offset: offset
+ *  The head travels from where the last access left it, a seek costs
+ *  seek_base plus seek_rate per byte of travel. The cost is only
+ *  accounted, moving the cursor itself is O(1)
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
 {
-   int numstep = 0;
+   int dist;
 
-   mp->cursor = 0;
-   while(numstep < offset && numstep < mp->maxsz){
-     /* Traverse sequentially */
-     mp->cursor = (mp->cursor + 1) % mp->maxsz;
-     numstep++;
+   if (offset < 0 || offset >= mp->maxsz)
+     return -1;
+
+   dist = offset > mp->cursor ? offset - mp->cursor : mp->cursor - offset;
+   if (dist != 0) {
+      mp->nr_seeks++;
+      mp->seek_cost += mp->seek_base + (unsigned long)dist * mp->seek_rate;
    }
+   mp->cursor = offset;
 
    return 0;
 }
@@ -38,11 +47,14 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
+   if (mp->rdmflg)
      return -1; /* Not compatible mode for sequential read */
 
-   MEMPHY_mv_csr(mp, addr);
+   if (MEMPHY_mv_csr(mp, addr) != 0)
+     return -1;
    *value = (BYTE) mp->storage[addr];
+   /* The head passes over the byte, streaming on costs no seek */
+   mp->cursor = (addr + 1) % mp->maxsz;
 
    return 0;
 }
@@ -78,11 +90,14 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
-     return -1; /* Not compatible mode for sequential read */
+   if (mp->rdmflg)
+     return -1; /* Not compatible mode for sequential write */
 
-   MEMPHY_mv_csr(mp, addr);
+   if (MEMPHY_mv_csr(mp, addr) != 0)
+     return -1;
    mp->storage[addr] = value;
+   MEMPHY_touch(mp, addr);
+   mp->cursor = (addr + 1) % mp->maxsz;
 
    return 0;
 }
@@ -98,14 +113,158 @@ int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
    if (mp == NULL)
      return -1;
 
-   if (mp->rdmflg)
+   if (mp->rdmflg) {
       mp->storage[addr] = data;
-   else /* Sequential access device */
+      MEMPHY_touch(mp, addr);
+   } else /* Sequential access device */
       return MEMPHY_seq_write(mp, addr, data);
 
    return 0;
 }
 
+/* Mark the frames of [n] bytes from [addr] as touched */
+static void MEMPHY_touch_range(struct memphy_struct *mp, int addr, int n)
+{
+   int fpn;
+
+   for (fpn = addr / PAGING_PAGESZ; fpn <= (addr + n - 1) / PAGING_PAGESZ; fpn++)
+      MEMPHY_touch_frame(mp, fpn);
+}
+
+/*
+ *  MEMPHY_read_bytes - read [n] bytes from [addr] of MEMPHY device
+ *  @mp: memphy struct
+ *  @addr: address
+ *  @buf: obtained bytes
+ *  @n: number of bytes
+ *  Random access devices copy the bytes in one go
+ */
+int MEMPHY_read_bytes(struct memphy_struct *mp, int addr, BYTE *buf, int n)
+{
+   int i;
+
+   if (mp == NULL || addr < 0 || n < 0 || addr + n > mp->maxsz)
+     return -1;
+
+   if (mp->rdmflg) {
+      memcpy(buf, mp->storage + addr, n);
+      return 0;
+   }
+   for (i = 0; i < n; i++)
+      if (MEMPHY_seq_read(mp, addr + i, &buf[i]) != 0)
+         return -1;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_write_bytes - write [n] bytes to [addr] of MEMPHY device
+ *  @mp: memphy struct
+ *  @addr: address
+ *  @buf: written bytes
+ *  @n: number of bytes
+ */
+int MEMPHY_write_bytes(struct memphy_struct *mp, int addr, const BYTE *buf, int n)
+{
+   int i;
+
+   if (mp == NULL || addr < 0 || n < 0 || addr + n > mp->maxsz)
+     return -1;
+   if (n == 0)
+     return 0;
+
+   if (mp->rdmflg) {
+      memcpy(mp->storage + addr, buf, n);
+      MEMPHY_touch_range(mp, addr, n);
+      return 0;
+   }
+   for (i = 0; i < n; i++)
+      if (MEMPHY_seq_write(mp, addr + i, buf[i]) != 0)
+         return -1;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_copy_frame - copy frame [srcfpn] of [mpsrc] over frame
+ *  [dstfpn] of [mpdst]
+ */
+int MEMPHY_copy_frame(struct memphy_struct *mpsrc, int srcfpn,
+                      struct memphy_struct *mpdst, int dstfpn)
+{
+   int addrsrc = srcfpn * PAGING_PAGESZ;
+   int addrdst = dstfpn * PAGING_PAGESZ;
+   BYTE page[PAGING_PAGESZ];
+
+   if (mpsrc == NULL || mpdst == NULL ||
+       addrsrc < 0 || addrsrc + PAGING_PAGESZ > mpsrc->maxsz ||
+       addrdst < 0 || addrdst + PAGING_PAGESZ > mpdst->maxsz)
+     return -1;
+
+   if (mpsrc->rdmflg && mpdst->rdmflg) {
+      memcpy(mpdst->storage + addrdst, mpsrc->storage + addrsrc, PAGING_PAGESZ);
+      MEMPHY_touch_frame(mpdst, dstfpn);
+      return 0;
+   }
+   /* A sequential device on either side, go through its cursor */
+   if (MEMPHY_read_bytes(mpsrc, addrsrc, page, PAGING_PAGESZ) != 0)
+     return -1;
+   return MEMPHY_write_bytes(mpdst, addrdst, page, PAGING_PAGESZ);
+}
+
+/*
+ *  MEMPHY_exchange_frames - swap the contents of frame [fpn1] of [mp1]
+ *  and frame [fpn2] of [mp2], the data movement of a swap-in paired
+ *  with the swap-out making room for it
+ */
+int MEMPHY_exchange_frames(struct memphy_struct *mp1, int fpn1,
+                           struct memphy_struct *mp2, int fpn2)
+{
+   int addr1 = fpn1 * PAGING_PAGESZ;
+   int addr2 = fpn2 * PAGING_PAGESZ;
+   BYTE page1[PAGING_PAGESZ], page2[PAGING_PAGESZ];
+
+   if (mp1 == NULL || mp2 == NULL ||
+       addr1 < 0 || addr1 + PAGING_PAGESZ > mp1->maxsz ||
+       addr2 < 0 || addr2 + PAGING_PAGESZ > mp2->maxsz)
+     return -1;
+
+   if (mp1->rdmflg && mp2->rdmflg) {
+      memcpy(page1, mp1->storage + addr1, PAGING_PAGESZ);
+      memcpy(mp1->storage + addr1, mp2->storage + addr2, PAGING_PAGESZ);
+      memcpy(mp2->storage + addr2, page1, PAGING_PAGESZ);
+      MEMPHY_touch_frame(mp1, fpn1);
+      MEMPHY_touch_frame(mp2, fpn2);
+      return 0;
+   }
+   if (MEMPHY_read_bytes(mp1, addr1, page1, PAGING_PAGESZ) != 0 ||
+       MEMPHY_read_bytes(mp2, addr2, page2, PAGING_PAGESZ) != 0)
+     return -1;
+   if (MEMPHY_write_bytes(mp1, addr1, page2, PAGING_PAGESZ) != 0)
+     return -1;
+   return MEMPHY_write_bytes(mp2, addr2, page1, PAGING_PAGESZ);
+}
+
+/*
+ *  MEMPHY_fill_frame - set every byte of frame [fpn] to [value]
+ */
+int MEMPHY_fill_frame(struct memphy_struct *mp, int fpn, BYTE value)
+{
+   int addr = fpn * PAGING_PAGESZ;
+   BYTE page[PAGING_PAGESZ];
+
+   if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+     return -1;
+
+   if (mp->rdmflg) {
+      memset(mp->storage + addr, value, PAGING_PAGESZ);
+      MEMPHY_touch_frame(mp, fpn);
+      return 0;
+   }
+   memset(page, value, PAGING_PAGESZ);
+   return MEMPHY_write_bytes(mp, addr, page, PAGING_PAGESZ);
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
@@ -114,80 +273,155 @@ int MEMPHY_format(struct memphy_struct *mp, int pagesz)
 {
     /* This setting come with fixed constant PAGESZ */
     int numfp = mp->maxsz / pagesz;
-    struct framephy_struct *newfst, *fst;
-    int iter = 0;
+    int iter;
 
     if (numfp <= 0)
       return -1;
 
-    /* Init head of free framephy list */ 
-    fst = malloc(sizeof(struct framephy_struct));
-    fst->fpn = iter;
-    mp->free_fp_list = fst;
-
-    /* We have list with first element, fill in the rest num-1 element member*/
-    for (iter = 1; iter < numfp ; iter++)
-    {
-       newfst =  malloc(sizeof(struct framephy_struct));
-       newfst->fpn = iter;
-       newfst->fp_next = NULL;
-       fst->fp_next = newfst;
-       fst = newfst;
+    /* Every frame is free, stacked so that frame 0 comes out first */
+    mp->free_fpn = malloc(numfp * sizeof(int));
+    mp->nr_frames = numfp;
+    mp->nr_free = numfp;
+    mp->free_map = calloc(BITS_TO_LONGS(numfp), sizeof(unsigned long));
+    for (iter = 0; iter < numfp; iter++) {
+       mp->free_fpn[iter] = numfp - 1 - iter;
+       set_bit(iter, mp->free_map);
     }
 
+    /* No frame holds a page yet */
+    mp->frames = calloc(numfp, sizeof(struct frame_entry));
+    mp->fifo_head = -1;
+    mp->fifo_tail = -1;
+    mp->clock_hand = 0;
+
     return 0;
 }
 
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
 {
-   struct framephy_struct *fp = mp->free_fp_list;
-
-   if (fp == NULL)
+   if (mp->nr_free == 0)
      return -1;
 
-   *retfpn = fp->fpn;
-   mp->free_fp_list = fp->fp_next;
-
-   /* MEMPHY is iteratively used up until its exhausted
-    * No garbage collector acting then it not been released
-    */
-   free(fp);
+   *retfpn = mp->free_fpn[--mp->nr_free];
+   clear_bit(*retfpn, mp->free_map);
 
    return 0;
 }
 
+/*
+ *  MEMPHY_get_freefps - take up to [n] free frames at once, in the order
+ *  [n] MEMPHY_get_freefp() calls would. Return how many were taken
+ */
+int MEMPHY_get_freefps(struct memphy_struct *mp, int *fpns, int n)
+{
+   int i;
+
+   if (n > mp->nr_free)
+     n = mp->nr_free;
+   for (i = 0; i < n; i++) {
+      fpns[i] = mp->free_fpn[mp->nr_free - 1 - i];
+      clear_bit(fpns[i], mp->free_map);
+   }
+   mp->nr_free -= n;
+
+   return n;
+}
+
+/*
+ *  MEMPHY_dump - print the non-zero bytes of the frames written since the
+ *  previous dump of the device (see memphy_struct.touched)
+ */
 int MEMPHY_dump(struct memphy_struct * mp)
 {
     /*TODO dump memphy contnt mp->storage 
      *     for tracing the memory content
      */ //DONE
-    printf("Memory Dump: \n");
+    trace_printf("Memory Dump: \n");
 
     if (mp == NULL || mp->storage == NULL)
     {
-      printf("Invalid memory\n");
+      trace_printf("Invalid memory\n");
       return -1;
     }
-    for (int i = 0; i < mp->maxsz; i++)
+    pthread_mutex_lock(&mp->lock);
+    MEMPHY_take_touched(mp);
+    for (int i = MEMPHY_next_touched(mp, 0); i < mp->maxsz;
+         i = MEMPHY_next_touched(mp, i + 1))
     {
       if (mp->storage[i] != 0)
       {
-         printf("Byte %08x: %d\n", i, mp->storage[i]);
+         trace_printf("Byte %08x: %d\n", i, mp->storage[i]);
       }
     }
-    printf("\n");
+    pthread_mutex_unlock(&mp->lock);
+    trace_printf("\n");
     return 0;
 }
 
+/*
+ *  MEMPHY_take_touched - move the frames written since the last dump to
+ *  the ones the dump walks, caller holds mp->lock
+ */
+void MEMPHY_take_touched(struct memphy_struct *mp)
+{
+   int w;
+
+   for (w = 0; w < BITS_TO_LONGS(MEMPHY_NR_FRAMES(mp)); w++)
+      mp->dumping[w] = __atomic_exchange_n(&mp->touched[w], 0,
+                                           __ATOMIC_ACQ_REL);
+}
+
+/*
+ *  MEMPHY_next_touched - first address at or after [addr] in a frame the
+ *  current dump took, maxsz when there is none. Walks the bitmap, not
+ *  the storage
+ */
+int MEMPHY_next_touched(struct memphy_struct *mp, int addr)
+{
+   int fpn = addr / PAGING_PAGESZ;
+
+   if (addr >= mp->maxsz || test_bit(fpn, mp->dumping))
+      return addr;
+   fpn = find_next_bit(mp->dumping, MEMPHY_NR_FRAMES(mp), fpn + 1);
+   addr = fpn * PAGING_PAGESZ;
+   return addr < mp->maxsz ? addr : mp->maxsz;
+}
+
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 {
-   struct framephy_struct *fp = mp->free_fp_list;
-   struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+   /* A frame already on the stack is a double free */
+   if (fpn < 0 || fpn >= mp->nr_frames || test_bit(fpn, mp->free_map))
+     return -1;
+
+   mp->free_fpn[mp->nr_free++] = fpn;
+   set_bit(fpn, mp->free_map);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_put_freefps - give [n] frames back at once, the same as
+ *  putting them one by one in array order. Nothing is put back when
+ *  one of them is already free
+ */
+int MEMPHY_put_freefps(struct memphy_struct *mp, const int *fpns, int n)
+{
+   int i;
+
+   for (i = 0; i < n; i++) {
+      if (fpns[i] < 0 || fpns[i] >= mp->nr_frames ||
+          test_bit(fpns[i], mp->free_map))
+        break;
+      set_bit(fpns[i], mp->free_map);
+   }
+   if (i < n) {
+      while (i-- > 0)
+        clear_bit(fpns[i], mp->free_map);
+      return -1;
+   }
 
-   /* Create new node with value fpn */
-   newnode->fpn = fpn;
-   newnode->fp_next = fp;
-   mp->free_fp_list = newnode;
+   memcpy(mp->free_fpn + mp->nr_free, fpns, n * sizeof(int));
+   mp->nr_free += n;
 
    return 0;
 }
@@ -198,33 +432,125 @@ int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
  */
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
 {
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
+   mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
    mp->maxsz = max_size;
+   mp->touched = calloc(BITS_TO_LONGS(MEMPHY_NR_FRAMES(mp)),
+                        sizeof(unsigned long));
+   mp->dumping = calloc(BITS_TO_LONGS(MEMPHY_NR_FRAMES(mp)),
+                        sizeof(unsigned long));
 
    MEMPHY_format(mp,PAGING_PAGESZ);
 
    mp->rdmflg = (randomflg != 0)?1:0;
+   pthread_mutex_init(&mp->lock, NULL);
 
    if (!mp->rdmflg )   /* Not Ramdom acess device, then it serial device*/
       mp->cursor = 0;
+   mp->seek_base = MEMPHY_SEEK_BASE;
+   mp->seek_rate = MEMPHY_SEEK_RATE;
+   mp->nr_seeks = 0;
+   mp->seek_cost = 0;
 
    return 0;
 }
 
+/*
+ *  Release MEMPHY struct storage and frame lists
+ */
+int free_memphy(struct memphy_struct *mp)
+{
+   free(mp->free_fpn);
+   mp->free_fpn = NULL;
+   mp->nr_free = 0;
+   free(mp->free_map);
+   mp->free_map = NULL;
+   free(mp->frames);
+   mp->frames = NULL;
+   free(mp->storage);
+   mp->storage = NULL;
+   free(mp->touched);
+   mp->touched = NULL;
+   free(mp->dumping);
+   mp->dumping = NULL;
+   pthread_mutex_destroy(&mp->lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_frame - frame table entry of [fpn], NULL when out of range
+ */
+struct frame_entry *MEMPHY_frame(struct memphy_struct *mp, int fpn)
+{
+   if (mp->frames == NULL || fpn < 0 || fpn >= mp->nr_frames)
+     return NULL;
+   return &mp->frames[fpn];
+}
+
+/*
+ *  MEMPHY_map_frame - record that frame [fpn] holds page [pgn] of
+ *  [owner], as the newest used frame
+ */
+int MEMPHY_map_frame(struct memphy_struct *mp, int fpn, struct mm_struct *owner,
+                     int pgn, struct pcb_t *p_owner)
+{
+   struct frame_entry *fe = MEMPHY_frame(mp, fpn);
+
+   if (fe == NULL)
+     return -1;
+   if (fe->owner != NULL) /* Reused in place, it turns newest */
+     MEMPHY_unmap_frame(mp, fpn);
+
+   fe->owner = owner;
+   fe->p_owner = p_owner;
+   fe->pid = p_owner != NULL ? p_owner->pid : 0;
+   fe->pgn = pgn;
+   fe->age = 0;
+   fe->swpfpn = -1;
+   fe->fifo_prev = mp->fifo_tail;
+   fe->fifo_next = -1;
+   if (mp->fifo_tail >= 0)
+     mp->frames[mp->fifo_tail].fifo_next = fpn;
+   else
+     mp->fifo_head = fpn;
+   mp->fifo_tail = fpn;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_unmap_frame - forget the page frame [fpn] holds, without
+ *  giving the frame back to the free pool
+ */
+int MEMPHY_unmap_frame(struct memphy_struct *mp, int fpn)
+{
+   struct frame_entry *fe = MEMPHY_frame(mp, fpn);
+
+   if (fe == NULL || fe->owner == NULL)
+     return -1;
+
+   if (fe->fifo_prev >= 0)
+     mp->frames[fe->fifo_prev].fifo_next = fe->fifo_next;
+   else
+     mp->fifo_head = fe->fifo_next;
+   if (fe->fifo_next >= 0)
+     mp->frames[fe->fifo_next].fifo_prev = fe->fifo_prev;
+   else
+     mp->fifo_tail = fe->fifo_prev;
+   fe->owner = NULL;
+   fe->p_owner = NULL;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_free_frame - unmap used frame [fpn] and give it back to the
+ *  free pool
+ */
 int MEMPHY_free_frame(struct memphy_struct *mp, int fpn) {
-   struct framephy_struct* fpit = mp->used_fp_list, *prev = NULL;
-   while(fpit!=NULL) {
-      if(fpit->fpn == fpn) {
-         if(prev==NULL) mp->used_fp_list = NULL;
-         else prev->fp_next = fpit->fp_next;
-         MEMPHY_put_freefp(mp, fpn);
-         free(fpit);
-         return 0;
-      }
-      prev = fpit;
-      fpit = fpit->fp_next;
-   }
-   return -1;
+   if (MEMPHY_unmap_frame(mp, fpn) != 0)
+     return -1;
+   return MEMPHY_put_freefp(mp, fpn);
 }
 
 //#endif
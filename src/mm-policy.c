@@ -0,0 +1,90 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Page replacement policies mm/mm-policy.c
+ */
+
+#include "mm.h"
+#include <string.h>
+
+/*
+ *  frame_referenced - test and clear the referenced bit of the page
+ *  held in used frame [fe]
+ */
+static int frame_referenced(struct frame_entry *fe)
+{
+   uint32_t *pte = &fe->owner->pgd[fe->pgn];
+   int ref = (*pte & PAGING_PTE_REFERENCED_MASK) != 0;
+
+   CLRBIT(*pte, PAGING_PTE_REFERENCED_MASK);
+   return ref;
+}
+
+/*
+ *  fifo_find_victim - the frame used the longest
+ */
+static int fifo_find_victim(struct memphy_struct *mp)
+{
+   return mp->fifo_head;
+}
+
+/*
+ *  clock_find_victim - second chance: the hand sweeps the frame table,
+ *  sparing and clearing referenced pages until it meets one that was
+ *  not referenced since the last sweep
+ */
+static int clock_find_victim(struct memphy_struct *mp)
+{
+   int n, fpn;
+
+   /* After one round every page is unreferenced */
+   for (n = 0; n < 2 * mp->nr_frames; n++) {
+      fpn = mp->clock_hand;
+      mp->clock_hand = (fpn + 1) % mp->nr_frames;
+      if (mp->frames[fpn].owner != NULL && !frame_referenced(&mp->frames[fpn]))
+        return fpn;
+   }
+   return -1;
+}
+
+/*
+ *  aging_find_victim - LRU approximation: every eviction shifts each
+ *  used frame's age right and puts its referenced bit on top, the
+ *  youngest age goes, the oldest frame on a tie
+ */
+static int aging_find_victim(struct memphy_struct *mp)
+{
+   struct frame_entry *fe;
+   int fpn, vicfpn = -1;
+
+   for (fpn = mp->fifo_head; fpn >= 0; fpn = fe->fifo_next) {
+      fe = &mp->frames[fpn];
+      fe->age = (fe->age >> 1) | (frame_referenced(fe) ? 0x80 : 0);
+      if (vicfpn < 0 || fe->age < mp->frames[vicfpn].age)
+        vicfpn = fpn;
+   }
+   return vicfpn;
+}
+
+const struct pg_policy pg_policy_fifo = { "fifo", fifo_find_victim };
+const struct pg_policy pg_policy_clock = { "clock", clock_find_victim };
+const struct pg_policy pg_policy_aging = { "aging", aging_find_victim };
+
+static const struct pg_policy *pg_policies[] = {
+   &pg_policy_fifo, &pg_policy_clock, &pg_policy_aging,
+};
+
+/*
+ *  pg_policy_by_name - policy called [name], NULL if there is none
+ */
+const struct pg_policy *pg_policy_by_name(const char *name)
+{
+   int i;
+
+   for (i = 0; i < sizeof(pg_policies) / sizeof(pg_policies[0]); i++)
+      if (strcmp(pg_policies[i]->name, name) == 0)
+        return pg_policies[i];
+   return NULL;
+}
+
+//#endif
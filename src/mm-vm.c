@@ -6,12 +6,11 @@
 
 #include "string.h"
 #include "mm.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 
-static pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER;
-
 /*enlist_vm_freerg_list - add new rg to freerg_list
  *@mm: memory region
  *@rg_elmt: new region
@@ -66,7 +65,7 @@ struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
  */
 struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
 {
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if(rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
     return NULL;
 
   return &mm->symrgtbl[rgid];
@@ -87,14 +86,16 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
   size = PAGING_PAGE_ALIGNSZ(size);
   if (size <= 0) return -1;
   
-  pthread_mutex_lock(&vm_lock);
+  pthread_mutex_lock(&caller->mram->lock);
   if (get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0)
   {
     caller->mm->symrgtbl[rgid].rg_start = rgnode.rg_start;
     caller->mm->symrgtbl[rgid].rg_end = rgnode.rg_end;
+    caller->mm->symrgtbl[rgid].allocated = 1;
 
     *alloc_addr = rgnode.rg_start;
-    pthread_mutex_unlock(&vm_lock);
+    pthread_mutex_unlock(&caller->mram->lock);
+    trace_ev(EV_ALLOC, caller->pid, rgid, size);
 
     return 0;
   }
@@ -121,7 +122,8 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
   caller->mm->symrgtbl[rgid].allocated = 1;
 
   *alloc_addr = old_sbrk;
-  pthread_mutex_unlock(&vm_lock);
+  pthread_mutex_unlock(&caller->mram->lock);
+  trace_ev(EV_ALLOC, caller->pid, rgid, size);
 
   return 0;
 }
@@ -135,7 +137,7 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
  */
 int __free(struct pcb_t *caller, int vmaid, int rgid)
 {
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if(rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
     return -1;
 
   /* TODO: Manage the collect freed region to freerg_list */
@@ -145,13 +147,13 @@ int __free(struct pcb_t *caller, int vmaid, int rgid)
   struct vm_rg_struct *free_rg = get_symrg_byid(caller->mm, rgid);
 
   if (free_rg->allocated != 1){
-    printf("Unable to delocated memory region %d\n", rgid);
+    trace(TRACE_IO, "Unable to delocated memory region %d\n", rgid);
     return -1;
   }
 
   if (free_rg->rg_start == free_rg->rg_end) return -1;
 
-  pthread_mutex_lock(&vm_lock);
+  pthread_mutex_lock(&caller->mram->lock);
 
   struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
 
@@ -167,7 +169,8 @@ int __free(struct pcb_t *caller, int vmaid, int rgid)
   /*enlist the obsoleted memory region */
   enlist_vm_freerg_list(caller->mm, rgnode);
 
-  pthread_mutex_unlock(&vm_lock);
+  pthread_mutex_unlock(&caller->mram->lock);
+  trace_ev(EV_FREE, caller->pid, rgid, 0);
 
   return 0;
 }
@@ -207,53 +210,75 @@ int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
 {
   uint32_t pte = mm->pgd[pgn];
  
+  if (!PAGING_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_SWAPPED_MASK))
+    return -1; /* Never mapped, there is nothing to fault in */
+
   if (!PAGING_PAGE_PRESENT(pte))
   { /* Page is not online, make it actively living */
     int vicpgn, swpfpn; 
-    int vicfpn;
-    uint32_t vicpte;
+    int vicfpn, tgtcopy;
 
     int tgtfpn = PAGING_SWP(pte); //the target frame storing our variable
 
+    trace_ev(EV_PGFAULT, caller->pid, pgn, 0);
+
     /* TODO: Play with your paging theory here */ // DONE
     /* Find victim page */
     struct framephy_struct *victim_fp = (struct framephy_struct *)malloc(sizeof(struct framephy_struct));
-    if (find_victim_page(caller, victim_fp) == -1) return -1;
+    if (find_victim_page(caller, victim_fp) == -1) {
+      free(victim_fp);
+      return -1;
+    }
     vicpgn = victim_fp->id;
-    vicpte = victim_fp->owner->pgd[vicpgn];
-    vicfpn = PAGING_FPN(vicpte);
-
-    /* Get free frame in MEMSWP */
-    if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) == -1) return -1;
+    vicfpn = victim_fp->fpn;
 
-
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy victim frame to swap */
-    __swap_cp_page(victim_fp->p_owner->mram, vicfpn, caller->active_mswp, swpfpn);
-    /* Copy target frame from swap to mem */
-    __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
-
-    /* Update page table */
-    pte_set_swap(&victim_fp->owner->pgd[vicpgn], 0, swpfpn);
+    if (swap_out_page(caller, victim_fp, &swpfpn) == 0) {
+      /* The target is copied in and keeps its swap frame as a copy,
+       * it needs no write back while it stays clean */
+      __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
+      tgtcopy = tgtfpn;
+    } else {
+      /* Swap is full: do swap frame from MEMRAM to MEMSWP and vice
+       * versa in one exchange, the victim moves out to the swap frame
+       * the target leaves */
+      if (MEMPHY_exchange_frames(caller->mram, vicfpn,
+                                 caller->active_mswp, tgtfpn) != 0) {
+        MEMPHY_map_frame(caller->mram, vicfpn, victim_fp->owner, vicpgn,
+                         victim_fp->p_owner);
+        free(victim_fp);
+        return -1;
+      }
+      swpfpn = tgtfpn;
+      tgtcopy = -1;
+      trace_ev(EV_SWAPOUT, victim_fp->p_owner->pid, vicpgn, swpfpn);
+      trace_ev(EV_WRITEBACK, victim_fp->p_owner->pid, vicpgn, swpfpn);
+
+      /* Update page table */
+      pte_set_swap(&victim_fp->owner->pgd[vicpgn], 0, swpfpn);
+      MEMPHY_map_frame(caller->active_mswp, swpfpn, victim_fp->owner, vicpgn,
+                       victim_fp->p_owner);
+    }
+    trace_ev(EV_SWAPIN, caller->pid, pgn, vicfpn);
 
     /* Update its online status of the target page */
     //pte_set_fpn() & mm->pgd[pgn];
      pte_set_fpn(&mm->pgd[pgn], vicfpn);
-    *fpn = PAGING_FPN(pte);
+    pte = mm->pgd[pgn];
 
 #ifdef CPU_TLB
     /* Update its online status of TLB (if needed) */
-    tlb_cache_set_invalid(caller->tlb, caller, vicpgn);
+    tlb_cache_set_invalid(caller->tlb, victim_fp->p_owner, vicpgn);
 
 
 #endif
 
     enlist_pgn_node(&caller->mm->fifo_pgn,pgn);
-    enlist_fpn_node(&caller->mram->used_fp_list, *fpn, caller->mm, pgn, caller);
-    MEMPHY_put_freefp(caller->active_mswp, tgtfpn);
+    MEMPHY_map_frame(caller->mram, vicfpn, caller->mm, pgn, caller);
+    caller->mram->frames[vicfpn].swpfpn = tgtcopy;
+    free(victim_fp);
   }
 
-  *fpn = PAGING_FPN(pte);
+  *fpn = PAGING_PTE_FPN(pte);
 
   return 0;
 }
@@ -273,6 +298,7 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
   if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
     return -1; /* invalid page access */
+  SETBIT(mm->pgd[pgn], PAGING_PTE_REFERENCED_MASK);
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -296,6 +322,8 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
   if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
     return -1; /* invalid page access */
+  SETBIT(mm->pgd[pgn], PAGING_PTE_REFERENCED_MASK);
+  SETBIT(mm->pgd[pgn], PAGING_PTE_DIRTY_MASK);
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -315,15 +343,17 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+  if (currg == NULL) /* Invalid memory identify */
+    return -1;
   if (!currg->allocated)
   {
-    printf("\tProcess %d read region=%d offset=%d\n", caller->pid, rgid, offset);
-    printf("\tProcess %d access violation reading location: memory region %d\n", caller->pid, rgid);
+    trace(TRACE_IO, "\tProcess %d read region=%d offset=%d\n", caller->pid, rgid, offset);
+    trace(TRACE_IO, "\tProcess %d access violation reading location: memory region %d\n", caller->pid, rgid);
     return -1;
   }
-  else if(currg->rg_start + offset > currg->rg_end) {
-    printf("\tProcess %d read region=%d offset=%d\n", caller->pid, rgid, offset);
-    printf("\tProcess %d access violation reading location: memory region %d\n", caller->pid, rgid);
+  else if(currg->rg_start + offset >= currg->rg_end) {
+    trace(TRACE_IO, "\tProcess %d read region=%d offset=%d\n", caller->pid, rgid, offset);
+    trace(TRACE_IO, "\tProcess %d access violation reading location: memory region %d\n", caller->pid, rgid);
     return -1;
   }
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
@@ -331,13 +361,13 @@ int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data)
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
 	  return -1;
 
-  pthread_mutex_lock(&vm_lock);
+  pthread_mutex_lock(&caller->mram->lock);
 
-  pg_getval(caller->mm, currg->rg_start + offset, data, caller);
+  int ret = pg_getval(caller->mm, currg->rg_start + offset, data, caller);
 
-  pthread_mutex_unlock(&vm_lock);
+  pthread_mutex_unlock(&caller->mram->lock);
 
-  return 0;
+  return ret;
 }
 
 
@@ -353,13 +383,11 @@ int pgread(
   if (val == -1) return -1;
 
   destination = (uint32_t) data;
-#ifdef IODUMP
-  printf("\tProcess %d read region=%d offset=%d value=%d\n\n", proc->pid, source, offset, data);
-#ifdef PAGETBL_DUMP
-  print_pgtbl(proc, 0, -1); //print max TBL
-#endif
-  MEMPHY_dump(proc->mram);
-#endif
+  trace(TRACE_IO, "\tProcess %d read region=%d offset=%d value=%d\n\n", proc->pid, source, offset, data);
+  if (trace_on(TRACE_DUMP)) {
+    print_pgtbl(proc, 0, -1); //print max TBL
+    MEMPHY_dump(proc->mram);
+  }
 
   return val;
 }
@@ -376,14 +404,16 @@ int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
 
+  if (currg == NULL) /* Invalid memory identify */
+    return -1;
   if (!currg->allocated){
-    printf("\tProcess %d write region=%d offset=%d value=%d\n", caller->pid, rgid, offset, value);
-    printf("\tProcess %d access violation writing location: memory region %d\n", caller->pid, rgid);
+    trace(TRACE_IO, "\tProcess %d write region=%d offset=%d value=%d\n", caller->pid, rgid, offset, value);
+    trace(TRACE_IO, "\tProcess %d access violation writing location: memory region %d\n", caller->pid, rgid);
     return -1;
   }
-  else if(currg->rg_start + offset > currg->rg_end) {
-    printf("\tProcess %d write region=%d offset=%d value=%d\n", caller->pid, rgid, offset, value);
-    printf("\tProcess %d access violation writing location: memory region %d\n", caller->pid, rgid);
+  else if(currg->rg_start + offset >= currg->rg_end) {
+    trace(TRACE_IO, "\tProcess %d write region=%d offset=%d value=%d\n", caller->pid, rgid, offset, value);
+    trace(TRACE_IO, "\tProcess %d access violation writing location: memory region %d\n", caller->pid, rgid);
     return -1;
   }
 
@@ -392,13 +422,13 @@ int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value)
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
 	  return -1;
 
-  pthread_mutex_lock(&vm_lock);
+  pthread_mutex_lock(&caller->mram->lock);
 
-  pg_setval(caller->mm, currg->rg_start + offset, value, caller);
+  int ret = pg_setval(caller->mm, currg->rg_start + offset, value, caller);
 
-  pthread_mutex_unlock(&vm_lock);
+  pthread_mutex_unlock(&caller->mram->lock);
 
-  return 0;
+  return ret;
 }
 
 /*pgwrite - PAGING-based write a region memory */
@@ -408,24 +438,20 @@ int pgwrite(
 		uint32_t destination, // Index of destination register
 		uint32_t offset)
 {
-#ifdef IODUMP
-  printf("process %d write region=%d offset=%d value=%d\n\n", proc->pid, destination, offset, data);
-#endif
+  trace(TRACE_IO, "process %d write region=%d offset=%d value=%d\n\n", proc->pid, destination, offset, data);
 
   uint32_t max_offset = proc->mm->symrgtbl[destination].rg_end - proc->mm->symrgtbl[destination].rg_start - 1;
 
   if (offset > max_offset){
-    printf("process %d access violation writing location: memory region %d\n", proc->pid, destination);
+    trace(TRACE_IO, "process %d access violation writing location: memory region %d\n", proc->pid, destination);
     return -1;
   }
 
   int status = __write(proc, 0, destination, offset, data);
-#ifdef PAGETBL_DUMP
-  if (status != -1) print_pgtbl(proc, 0, -1); // print max TBL
-#endif
-#ifdef IODUMP
-  MEMPHY_dump(proc->mram);
-#endif
+  if (trace_on(TRACE_DUMP)) {
+    if (status != -1) print_pgtbl(proc, 0, -1); // print max TBL
+    MEMPHY_dump(proc->mram);
+  }
 
   return status;
 }
@@ -448,7 +474,7 @@ int free_pcb_memph(struct pcb_t *caller)
 
     if (!PAGING_PAGE_PRESENT(pte))
     {
-      fpn = PAGING_FPN(pte);
+      fpn = PAGING_PTE_FPN(pte);
       MEMPHY_put_freefp(caller->mram, fpn);
     } else {
       fpn = PAGING_SWP(pte);
@@ -516,7 +542,7 @@ int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int
  */
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
 {
-  struct vm_rg_struct * newrg = malloc(sizeof(struct vm_rg_struct));
+  struct vm_rg_struct newrg;
   int inc_amt = PAGING_PAGE_ALIGNSZ(inc_sz);
   int incnumpage =  inc_amt / PAGING_PAGESZ;
   struct vm_rg_struct *area = get_vm_area_node_at_brk(caller, vmaid, inc_sz, inc_amt);
@@ -525,22 +551,22 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
   int old_end = cur_vma->vm_end;
 
   /*Validate overlap of obtained region */
-  if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) < 0)
+  if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) < 0) {
+    free(area);
     return -1; /*Overlap and failed allocation */
+  }
 
   /* The obtained vm area (only) 
    * now will be alloc real ram region */
   cur_vma->vm_end += inc_sz;
   cur_vma->sbrk += inc_sz; // Update the sbrk field to reflect the new vm_end value
   if (vm_map_ram(caller, area->rg_start, area->rg_end, 
-                    old_end, incnumpage , newrg) < 0)
+                    old_end, incnumpage , &newrg) < 0) {
+    free(area);
     return -1; /* Map the memory to MEMRAM */
+  }
 
-  // assign new region to new memory of vm area
-  struct vm_rg_struct *new_rg = malloc(sizeof(struct vm_rg_struct));
-  new_rg->rg_start = old_end;
-  new_rg->rg_end = cur_vma->sbrk;
-
+  free(area);
   return 0;
 
 }
@@ -552,9 +578,10 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
  */
 int find_victim_page(struct pcb_t *caller, struct framephy_struct *re_fp) 
 {
-  struct framephy_struct *fp_q = caller->mram->used_fp_list;
-  struct framephy_struct *prev = NULL; 
+  struct memphy_struct *mram = caller->mram;
   struct vm_rg_struct *victim_rg = malloc(sizeof(struct vm_rg_struct)); 
+  struct frame_entry *fe = NULL;
+  int vicfpn = -1;
 
   /* TODO: Implement the theorical mechanism to find the victim page */ // DONE
     // check if free region list have frame
@@ -562,44 +589,61 @@ int find_victim_page(struct pcb_t *caller, struct framephy_struct *re_fp)
       
       int vicpgn = PAGING_PGN(victim_rg->rg_start);
       uint32_t vicpte = caller->mm->pgd[vicpgn];
-      int vicfpn = PAGING_FPN(vicpte);
 
-      // TODO: remove the node in used_fp_list match fpn = vicfpn then return that node in re_fp // DONE
-      while (fp_q != NULL){
-        if (fp_q->fpn == vicfpn){
-          // Remove the node from the list
-          if (prev != NULL) prev->fp_next = fp_q->fp_next;
-          else caller->mram->used_fp_list = fp_q->fp_next;
-          // Set re_fp to the removed node
-          re_fp = fp_q;
+      /* The frame table tells whether the freed page still holds a frame */
+      vicfpn = PAGING_PTE_FPN(vicpte);
+      fe = MEMPHY_frame(mram, vicfpn);
+      if (fe == NULL || fe->owner != caller->mm || fe->pgn != vicpgn)
+        vicfpn = -1;
+    }
+    free(victim_rg);
 
-          // Free the victim_rg memory
-          free(victim_rg);
+    // Otherwise the replacement policy of the RAM picks it
+    if (vicfpn < 0)
+      vicfpn = (mram->policy != NULL ? mram->policy : &pg_policy_fifo)->find_victim(mram);
+    if (vicfpn < 0) return -1; // No frame is used, which should not happen
 
-          return 0;
-        }
-        prev = fp_q;
-        fp_q = fp_q->fp_next;
-      }
-    
-    }
+    fe = &mram->frames[vicfpn];
+    re_fp->fpn = vicfpn;
+    re_fp->owner = fe->owner;
+    re_fp->id = fe->pgn;
+    re_fp->p_owner = fe->p_owner;
+    re_fp->fp_next = NULL;
 
-    if (fp_q == NULL) return -1; // The FIFO queue is empty, which should not happen
+    // Remove the victim from the FIFO queue
+    MEMPHY_unmap_frame(mram, vicfpn);
 
-    // Traverse to the end of the FIFO queue to find the oldest page
-    while (fp_q->fp_next != NULL){
-      prev = fp_q;
-      fp_q = fp_q->fp_next;
-    }
+    return 0;
+}
+
+/*swap_out_page - move a victim page out of its RAM frame
+ *@caller: caller
+ *@vic: victim from find_victim_page()
+ *@swpfpn: return swap frame holding the page
+ *
+ *A clean page whose swap copy is still there is not written back, a
+ *dirty one is written over its copy or to a free swap frame
+ */
+int swap_out_page(struct pcb_t *caller, struct framephy_struct *vic, int *swpfpn)
+{
+  struct memphy_struct *mswp = caller->active_mswp;
+  uint32_t vicpte = vic->owner->pgd[vic->id];
+  int copy = caller->mram->frames[vic->fpn].swpfpn;
 
-    // Get the page number of the oldest page
-    re_fp = fp_q;
+  if (copy < 0 || (vicpte & PAGING_PTE_DIRTY_MASK))
+  {
+    if (copy < 0 && MEMPHY_get_freefp(mswp, &copy) != 0)
+      return -1;
+    __swap_cp_page(caller->mram, vic->fpn, mswp, copy);
+    trace_ev(EV_WRITEBACK, vic->p_owner->pid, vic->id, copy);
+  }
+  trace_ev(EV_SWAPOUT, vic->p_owner->pid, vic->id, copy);
 
-    // Remove the oldest page from the FIFO queue
-    if (prev != NULL) prev->fp_next = NULL;
-    else caller->mram->used_fp_list = NULL;
+  pte_set_swap(&vic->owner->pgd[vic->id], 0, copy);
+  MEMPHY_map_frame(mswp, copy, vic->owner, vic->id, vic->p_owner);
+  *swpfpn = copy;
 
-    return 0;
+  return 0;
 }
 
 /*get_free_vmrg_area - get a free vm region
@@ -5,6 +5,7 @@
  */
 
 #include "mm.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -51,7 +52,8 @@ int init_pte(uint32_t *pte,
  */
 int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
 {
-  SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
+  /* A swapped page is offline, the next access to it faults */
+  CLRBIT(*pte, PAGING_PTE_PRESENT_MASK);
   SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
 
   SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
@@ -69,7 +71,11 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_REFERENCED_MASK);
+  CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
 
+  /* Drop the swap offset a page swapped back in still carries */
+  SETVAL(*pte, 0, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT); 
 
   return 0;
@@ -107,7 +113,7 @@ int vmap_page_range(struct pcb_t *caller, // process call
    /* Tracking for later page replacement activities (if needed)
     * Enqueue new usage page */
     enlist_pgn_node(&caller->mm->fifo_pgn, pgn+pgit);
-    enlist_fpn_node(&caller->mram->used_fp_list, fpit->fpn, caller->mm, pgn + pgit, caller);
+    MEMPHY_map_frame(caller->mram, fpit->fpn, caller->mm, pgn + pgit, caller);
 
     fpit->p_owner = caller;
     fpit->id = pgn + pgit;
@@ -126,44 +132,55 @@ int vmap_page_range(struct pcb_t *caller, // process call
 
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct** frm_lst)
 {
-  int pgit, fpn;
+  int pgit, nr_free, nr_back;
+  int *fpns = malloc(req_pgnum * sizeof(int));
   struct framephy_struct *newfp_str = NULL;
 
+  /* Take what the free pool has in one go, evict for the rest */
+  nr_free = MEMPHY_get_freefps(caller->mram, fpns, req_pgnum);
+
   for(pgit = 0; pgit < req_pgnum; pgit++)
   {
     newfp_str = (struct framephy_struct *)malloc(sizeof(struct framephy_struct));
-    if(MEMPHY_get_freefp(caller->mram, &fpn) == 0)
+    if(pgit < nr_free)
     {
-     newfp_str->fpn = fpn;
+     newfp_str->fpn = fpns[pgit];
      newfp_str->owner = caller->mm;
     } 
     else 
     {  
       // ERROR CODE of obtaining somes but not enough frames
       int vicpgn, swpfpn;
-      struct framephy_struct *vic_fp = (struct framephy_struct *)malloc(sizeof(struct framephy_struct));
-      if (find_victim_page(caller, vic_fp) == -1 || MEMPHY_get_freefp(caller->active_mswp, &swpfpn) == -1)
+      struct framephy_struct *vic_fp = (struct framephy_struct *)calloc(1, sizeof(struct framephy_struct));
+      if (find_victim_page(caller, vic_fp) == -1 || swap_out_page(caller, vic_fp, &swpfpn) == -1)
       {
         struct framephy_struct *freefp_str = NULL;
+        /* A victim no swap frame was found for stays in RAM */
+        if (vic_fp->owner != NULL)
+          MEMPHY_map_frame(caller->mram, vic_fp->fpn, vic_fp->owner, vic_fp->id, vic_fp->p_owner);
+        /* Hand every frame gathered so far back at once */
+        nr_back = 0;
         while (*frm_lst != NULL)
         {
           freefp_str = *frm_lst;
-          MEMPHY_put_freefp(caller->mram, freefp_str->fpn);
+          fpns[nr_back++] = freefp_str->fpn;
           *frm_lst = (*frm_lst)->fp_next;
           free(freefp_str);
         }
+        MEMPHY_put_freefps(caller->mram, fpns, nr_back);
+        free(vic_fp);
+        free(newfp_str);
+        free(fpns);
         return -3000;
       }
       vicpgn = vic_fp->id;
-      uint32_t vicpte = vic_fp->owner->pgd[vicpgn];
-      int vicfpn = PAGING_FPN(vicpte);
+      int vicfpn = vic_fp->fpn;
 #ifdef CPU_TLB
     // update on TLB
-    tlb_cache_set_invalid(caller->tlb, caller, vicpgn);
+    tlb_cache_set_invalid(caller->tlb, vic_fp->p_owner, vicpgn);
 
 #endif
-    __swap_cp_page(vic_fp->p_owner->mram, vicfpn, caller->active_mswp, swpfpn);
-    pte_set_swap(&vic_fp->owner->pgd[vicpgn], 0, swpfpn);
+    free(vic_fp);
     newfp_str->fpn = vicfpn;
     newfp_str->owner = caller->mm;
     } 
@@ -171,6 +188,7 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
     *frm_lst = newfp_str;
  }
 
+  free(fpns);
   return 0;
 }
 
@@ -205,7 +223,7 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
   if (ret_alloc == -3000) 
   {
 #ifdef MMDBG
-     printf("OOM: vm_map_ram out of memory \n");
+     trace_printf("OOM: vm_map_ram out of memory \n");
 #endif
      return -1;
   }
@@ -214,6 +232,14 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
    * do the swaping all to swapper to get the all in ram */
   vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
 
+  /* The frame table tracks the mapped frames, drop the list */
+  while (frm_lst != NULL)
+  {
+    struct framephy_struct *fp = frm_lst;
+    frm_lst = fp->fp_next;
+    free(fp);
+  }
+
   return 0;
 }
 
@@ -226,19 +252,7 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) 
 {
-  int cellidx;
-  int addrsrc,addrdst;
-  for(cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
-  {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
-
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    MEMPHY_write(mpdst, addrdst, data);
-  }
-
-  return 0;
+  return MEMPHY_copy_frame(mpsrc, srcfpn, mpdst, dstfpn);
 }
 
 /*
@@ -250,7 +264,7 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
 {
   struct vm_area_struct * vma = malloc(sizeof(struct vm_area_struct));
 
-  mm->pgd = malloc(PAGING_MAX_PGN*sizeof(uint32_t));
+  mm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
 
   /* By default the owner comes with at least one vma */
   vma->vm_id = 1;
@@ -258,6 +272,7 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   vma->vm_end = vma->vm_start;
   vma->sbrk = vma->vm_start;
   struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end);
+  vma->vm_freerg_list = NULL;
   enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
 
   vma->vm_next = NULL;
@@ -268,6 +283,35 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   return 0;
 }
 
+/*
+ * Free an mm and everything hanging off it, once no frame maps it
+ * @mm:     self mm
+ */
+void free_mm(struct mm_struct *mm)
+{
+  struct vm_area_struct *vma;
+  struct vm_rg_struct *rg;
+  struct pgn_t *pg;
+
+  while ((vma = mm->mmap) != NULL)
+  {
+    mm->mmap = vma->vm_next;
+    while ((rg = vma->vm_freerg_list) != NULL)
+    {
+      vma->vm_freerg_list = rg->rg_next;
+      free(rg);
+    }
+    free(vma);
+  }
+  while ((pg = mm->fifo_pgn) != NULL)
+  {
+    mm->fifo_pgn = pg->pg_next;
+    free(pg);
+  }
+  free(mm->pgd);
+  free(mm);
+}
+
 struct vm_rg_struct* init_vm_rg(int rg_start, int rg_end)
 {
   struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
@@ -316,15 +360,15 @@ int print_list_fp(struct framephy_struct *ifp)
 {
    struct framephy_struct *fp = ifp;
  
-   printf("print_list_fp: ");
-   if (fp == NULL) {printf("NULL list\n"); return -1;}
-   printf("\n");
+   trace_printf("print_list_fp: ");
+   if (fp == NULL) {trace_printf("NULL list\n"); return -1;}
+   trace_printf("\n");
    while (fp != NULL )
    {
-       printf("fp[%d]\n",fp->fpn);
+       trace_printf("fp[%d]\n",fp->fpn);
        fp = fp->fp_next;
    }
-   printf("\n");
+   trace_printf("\n");
    return 0;
 }
 
@@ -332,15 +376,15 @@ int print_list_rg(struct vm_rg_struct *irg)
 {
    struct vm_rg_struct *rg = irg;
  
-   printf("print_list_rg: ");
-   if (rg == NULL) {printf("NULL list\n"); return -1;}
-   printf("\n");
+   trace_printf("print_list_rg: ");
+   if (rg == NULL) {trace_printf("NULL list\n"); return -1;}
+   trace_printf("\n");
    while (rg != NULL)
    {
-       printf("rg[%ld->%ld]\n",rg->rg_start, rg->rg_end);
+       trace_printf("rg[%ld->%ld]\n",rg->rg_start, rg->rg_end);
        rg = rg->rg_next;
    }
-   printf("\n");
+   trace_printf("\n");
    return 0;
 }
 
@@ -348,29 +392,29 @@ int print_list_vma(struct vm_area_struct *ivma)
 {
    struct vm_area_struct *vma = ivma;
  
-   printf("print_list_vma: ");
-   if (vma == NULL) {printf("NULL list\n"); return -1;}
-   printf("\n");
+   trace_printf("print_list_vma: ");
+   if (vma == NULL) {trace_printf("NULL list\n"); return -1;}
+   trace_printf("\n");
    while (vma != NULL )
    {
-       printf("va[%ld->%ld]\n",vma->vm_start, vma->vm_end);
+       trace_printf("va[%ld->%ld]\n",vma->vm_start, vma->vm_end);
        vma = vma->vm_next;
    }
-   printf("\n");
+   trace_printf("\n");
    return 0;
 }
 
 int print_list_pgn(struct pgn_t *ip)
 {
-   printf("print_list_pgn: ");
-   if (ip == NULL) {printf("NULL list\n"); return -1;}
-   printf("\n");
+   trace_printf("print_list_pgn: ");
+   if (ip == NULL) {trace_printf("NULL list\n"); return -1;}
+   trace_printf("\n");
    while (ip != NULL )
    {
-       printf("va[%d]-\n",ip->pgn);
+       trace_printf("va[%d]-\n",ip->pgn);
        ip = ip->pg_next;
    }
-   printf("n");
+   trace_printf("n");
    return 0;
 }
 
@@ -387,23 +431,23 @@ int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
   pgn_start = PAGING_PGN(start);
   pgn_end = PAGING_PGN(end);
 
-  printf("\t*** Print_pgtbl (PID: %d): %d - %d",caller->pid, start, end);
-  if (caller == NULL) {printf("NULL caller\n"); return -1;}
-    printf("\n");
+  trace_printf("\t*** Print_pgtbl (PID: %d): %d - %d",caller->pid, start, end);
+  if (caller == NULL) {trace_printf("NULL caller\n"); return -1;}
+    trace_printf("\n");
 
 
   for(pgit = pgn_start; pgit < pgn_end; pgit++)
   {
-     printf("\t    %08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+     trace_printf("\t    %08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
   }
 
   for(pgit = pgn_start; pgit < pgn_end; pgit++)
   {
     int pte = caller->mm->pgd[pgit];
     if(PAGING_PAGE_PRESENT(pte))
-      printf("\t    Page: %d - Frame on mram: %d\n", pgit, PAGING_FPN(pte));
+      trace_printf("\t    Page: %d - Frame on mram: %d\n", pgit, PAGING_PTE_FPN(pte));
     else
-      printf("\t    Page: %d - Frame on mswp: %d\n", pgit, PAGING_SWP(pte));
+      trace_printf("\t    Page: %d - Frame on mswp: %d\n", pgit, PAGING_SWP(pte));
   }
 
   return 0;
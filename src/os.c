@@ -4,27 +4,17 @@
 #include "sched.h"
 #include "loader.h"
 #include "mm.h"
+#include "trace.h"
 
+#include <glob.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-
-static int time_slot;
-static int num_cpus;
-static int done = 0;
-
-static int hit_time = 0;
-static int miss_time = 0;
-
-#ifdef CPU_TLB
-static int tlbsz;
-#endif
+#include <unistd.h>
 
 #ifdef MM_PAGING
-static int memramsz;
-static int memswpsz[PAGING_MAX_MMSWP];
-
 struct mmpaging_ld_args {
 	/* A dispatched argument struct to compact many-fields passing to loader */
 	struct memphy_struct *tlb;
@@ -35,151 +25,383 @@ struct mmpaging_ld_args {
 };
 #endif
 
-static struct ld_args{
+struct ld_args{
 	char ** path;
 	unsigned long * start_time;
 #ifdef MLQ_SCHED
 	unsigned long * prio;
 #endif
-} ld_processes;
-int num_processes;
-struct memphy_struct tlb;
+};
+
+struct os_instance;
 
 struct cpu_args {
+	struct os_instance * os;
 	struct timer_id_t * timer_id;
 	int id;
+	/* CPU state, kept across time slots */
+	struct pcb_t * proc;
+	int time_left;
+	int stopped;
 };
 
+struct loader_args {
+	struct os_instance * os;
+	struct timer_id_t * timer_id;
+#ifdef MM_PAGING
+	struct mmpaging_ld_args * mm;
+#endif
+	/* Loader state, kept across time slots */
+	int next;		// Index of the next process in ld_processes
+
+	/* Prefetch stage, parses programs ahead of their start time */
+	struct pcb_t ** ready;	// Parsed process of every index, NULL until then
+	int next_parse;		// Index of the next process to parse
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t parsed;	// A process was stored to ready
+	pthread_cond_t space;	// next moved on, the window has room again
+	pthread_t * workers;
+	int nr_workers;		// 0 parses inline at admission
+};
 
-static void * cpu_routine(void * args) {
-	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
-	int id = ((struct cpu_args*)args)->id;
-	/* Check for new process in ready queue */
-	int time_left = 0;
-	struct pcb_t * proc = NULL;
-	while (1) {
-		/* Check the status of current process */
-		if (proc == NULL) {
-			/* No process is running, the we load new process from
-		 	* ready queue */
-			proc = get_proc();
-			if (proc == NULL) {
-						if(done) {printf("\tCPU %d stopped\n", id); break; }
-                           next_slot(timer_id);
-                           continue; /* First load failed. skip dummy load */
-                        }
-		}else if (proc->pc == proc->code->size) {
-			/* The porcess has finish it job */
-			printf("\tCPU %d: Processed %2d has finished\n",
-				id ,proc->pid);
-			hit_time += proc->stat_hit_time;
-			miss_time += proc->stat_miss_time;
-			end_proc(&proc);
-			proc = get_proc();
-			time_left = 0;
-		}else if (time_left == 0) {
-			/* The process has done its job in current time slot */
-			printf("\tCPU %d: Put process %2d to run queue\n",
-				id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
-		}
-		
-		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
-			/* No process to run, exit */
-			printf("\tCPU %d stopped\n", id);
-			break;
-		}else if (proc == NULL) {
-			/* There may be new processes to run in
-			 * next time slots, just skip current slot */
-			next_slot(timer_id);
-			continue;
-		}else if (time_left == 0) {
-			printf("\tCPU %d: Dispatched process %2d\n",
-				id, proc->pid);
-			time_left = time_slot;
+/* Parser threads of the loader and how far past the next admission
+ * they may run */
+#define LD_PREFETCH_WORKERS	2
+#define LD_PREFETCH_DEPTH	64
+/* Stored to ready for a program that failed to load */
+#define LD_BAD_PROG		((struct pcb_t *)-1)
+
+/*
+ * Everything one simulation owns: its config, scheduler, clock, memory
+ * devices and the CPU and loader state. Instances share no mutable
+ * state, so a process can host several of them side by side.
+ */
+struct os_instance {
+	/* Config */
+	int time_slot;
+	int num_cpus;
+	int num_processes;
+	struct ld_args ld_processes;
+#ifdef CPU_TLB
+	int tlbsz;
+#endif
+#ifdef MM_PAGING
+	int memramsz;
+	int memswpsz[PAGING_MAX_MMSWP];
+	const struct pg_policy * policy;	// Page replacement of the RAM
+#endif
+
+	/* Run state */
+	int done;		// Every process is loaded
+	int failed;		// Some program could not be loaded
+	int hit_time;		// Summed by CPUs as processes end
+	int miss_time;
+	uint32_t avail_pid;	// PID of the next loaded process
+	struct sched_struct * sched;
+	struct timer_struct timer;
+	struct prog_cache * progs;	// Programs read so far
+	struct trace_ctx trace;	// Verbosity, trace output and event log
+
+	/* Devices */
+	struct memphy_struct tlb;
+#ifdef MM_PAGING
+	struct memphy_struct mram;
+	struct memphy_struct mswp[PAGING_MAX_MMSWP];
+	struct mmpaging_ld_args mm_ld_args;
+#endif
+
+	struct cpu_args * cpus;
+	struct loader_args ld;
+};
+
+/* Run CPU [cpu] for one time slot. Return 1 once the CPU stopped,
+ * otherwise 0 with the slot it next has work in stored to [wake] */
+static int cpu_step(struct cpu_args * cpu, uint64_t * wake) {
+	struct os_instance * os = cpu->os;
+	int id = cpu->id;
+	/* Check the status of current process */
+	if (cpu->proc == NULL) {
+		/* No process is running, the we load new process from
+	 	* ready queue */
+		cpu->proc = get_proc(os->sched);
+		if (cpu->proc == NULL) {
+			if(os->done) {trace(TRACE_EVENT, "\tCPU %d stopped\n", id); return 1; }
+			*wake = TIMER_NEVER;
+			return 0; /* First load failed. skip dummy load */
 		}
-		
-		/* Run current process */
-		run(proc);
-		time_left--;
-		next_slot(timer_id);
+	}else if (cpu->proc->pc == cpu->proc->code->size) {
+		/* The porcess has finish it job */
+		trace(TRACE_EVENT, "\tCPU %d: Processed %2d has finished\n",
+			id ,cpu->proc->pid);
+		__atomic_add_fetch(&os->hit_time, cpu->proc->stat_hit_time,
+			__ATOMIC_RELAXED);
+		__atomic_add_fetch(&os->miss_time, cpu->proc->stat_miss_time,
+			__ATOMIC_RELAXED);
+		end_proc(os->sched, &cpu->proc);
+		cpu->proc = get_proc(os->sched);
+		cpu->time_left = 0;
+	}else if (cpu->time_left == 0) {
+		/* The process has done its job in current time slot */
+		trace(TRACE_EVENT, "\tCPU %d: Put process %2d to run queue\n",
+			id, cpu->proc->pid);
+		put_proc(os->sched, cpu->proc);
+		cpu->proc = get_proc(os->sched);
 	}
-	detach_event(timer_id);
-	pthread_exit(NULL);
+	
+	/* Recheck process status after loading new process */
+	if (cpu->proc == NULL && os->done) {
+		/* No process to run, exit */
+		trace(TRACE_EVENT, "\tCPU %d stopped\n", id);
+		return 1;
+	}else if (cpu->proc == NULL) {
+		/* There may be new processes to run in
+		 * next time slots, just skip current slot */
+		*wake = TIMER_NEVER;
+		return 0;
+	}else if (cpu->time_left == 0) {
+		trace(TRACE_EVENT, "\tCPU %d: Dispatched process %2d\n",
+			id, cpu->proc->pid);
+		cpu->time_left = os->time_slot;
+	}
+	
+	/* Run current process */
+	run(cpu->proc);
+	cpu->time_left--;
+	*wake = current_time(&os->timer) + 1;
+	return 0;
 }
 
-static void * ld_routine(void * args) {
-#ifdef MM_PAGING
-	struct memphy_struct* mram = ((struct mmpaging_ld_args *)args)->mram;
-	struct memphy_struct** mswp = ((struct mmpaging_ld_args *)args)->mswp;
-	struct memphy_struct* active_mswp = ((struct mmpaging_ld_args *)args)->active_mswp;
-	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
-#else
-	struct timer_id_t * timer_id = (struct timer_id_t*)args;
+#ifndef SIM_DES
+/* Parse the programs of upcoming arrivals so admission only has to
+ * hand them to the scheduler */
+static void * ld_prefetch_routine(void * args) {
+	struct loader_args * ld = (struct loader_args *)args;
+	struct os_instance * os = ld->os;
+	struct pcb_t * proc;
+	int i;
+
+	trace_bind(&os->trace, NULL, NULL, -1);	/* Loader errors */
+	pthread_mutex_lock(&ld->lock);
+	for (;;) {
+		while (!ld->stop && ld->next_parse < os->num_processes
+				&& ld->next_parse >= ld->next + LD_PREFETCH_DEPTH)
+			pthread_cond_wait(&ld->space, &ld->lock);
+		if (ld->stop || ld->next_parse >= os->num_processes)
+			break;
+		i = ld->next_parse++;
+		pthread_mutex_unlock(&ld->lock);
+
+		/* PIDs are handed out at admission, in arrival order */
+		proc = load(os->progs, os->ld_processes.path[i], 0);
+
+		pthread_mutex_lock(&ld->lock);
+		ld->ready[i] = proc != NULL ? proc : LD_BAD_PROG;
+		pthread_cond_broadcast(&ld->parsed);
+	}
+	pthread_mutex_unlock(&ld->lock);
+	return NULL;
+}
 #endif
-	int i = 0;
-	printf("ld_routine\n");
-	while (i < num_processes) {
-		struct pcb_t * proc = load(ld_processes.path[i]);
+
+/* Take the parsed process at [next] and move past it, waiting for the
+ * prefetch workers if they fell behind. NULL if it failed to load */
+static struct pcb_t * ld_take(struct loader_args * ld) {
+	struct os_instance * os = ld->os;
+	struct pcb_t * proc;
+	int i = ld->next;
+
+	if (ld->nr_workers == 0) {
+		ld->next++;
+		return load(os->progs, os->ld_processes.path[i], 0);
+	}
+
+	pthread_mutex_lock(&ld->lock);
+	while (ld->ready[i] == NULL)
+		pthread_cond_wait(&ld->parsed, &ld->lock);
+	proc = ld->ready[i];
+	ld->ready[i] = NULL;
+	ld->next++;
+	pthread_cond_broadcast(&ld->space);
+	pthread_mutex_unlock(&ld->lock);
+	return proc != LD_BAD_PROG ? proc : NULL;
+}
+
+/* Admit at most one process in the current time slot, exactly at its
+ * start time. Return 1 once every process is loaded, otherwise 0 with
+ * the slot the loader next has work in stored to [wake] */
+static int ld_step(struct loader_args * ld, uint64_t * wake) {
+	struct os_instance * os = ld->os;
+	struct ld_args * procs = &os->ld_processes;
+	int i = ld->next;
+	struct pcb_t * proc;
+
+	if (i >= os->num_processes) {
+		os->done = 1;
+		return 1;
+	}
+	if (current_time(&os->timer) < procs->start_time[i]) {
+		*wake = procs->start_time[i];
+		return 0;
+	}
+
+	proc = ld_take(ld);
+	if (proc == NULL) {
+		/* The loader said why, run the rest and fail the simulation */
+		os->failed = 1;
+		return ld_step(ld, wake);
+	}
+	proc->pid = os->avail_pid++;
 #ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
+	proc->prio = procs->prio[i];
 #endif
-		while (current_time() < ld_processes.start_time[i]) {
-			next_slot(timer_id);
-		}
-		
 #ifdef MM_PAGING
-		proc->mm = malloc(sizeof(struct mm_struct));
-		init_mm(proc->mm, proc);
-		proc->mram = mram;
-		proc->mswp = mswp;
-		proc->active_mswp = active_mswp;
+	proc->mm = calloc(1, sizeof(struct mm_struct));
+	init_mm(proc->mm, proc);
+	proc->mram = ld->mm->mram;
+	proc->mswp = ld->mm->mswp;
+	proc->active_mswp = ld->mm->active_mswp;
 #endif
 #ifdef CPU_TLB
-		proc->stat_hit_time = 0;
-		proc->stat_miss_time = 0;
-		proc->tlb = &tlb;
+	proc->stat_hit_time = 0;
+	proc->stat_miss_time = 0;
+	proc->tlb = &os->tlb;
 #endif
-		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
-			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
-		add_proc(proc);
-		free(ld_processes.path[i]);
-		i++;
-		next_slot(timer_id);
+	trace(TRACE_EVENT, "\tLoaded a process at %s, PID: %d PRIO: %ld\n",
+		procs->path[i], proc->pid, procs->prio[i]);
+	trace_ev(EV_LOAD, proc->pid, procs->prio[i], 0);
+	add_proc(os->sched, proc);
+	*wake = current_time(&os->timer) + 1;
+	return 0;
+}
+
+#ifdef SIM_DES
+/*
+ * Discrete-event engine: a single thread steps the loader and then every
+ * CPU in id order once per time slot. Each device arrives at the slot
+ * barrier without waiting, the last arrival moves the clock forward, so
+ * the run is deterministic and pays no thread switches. The threaded
+ * build runs its CPUs side by side once the loader is done with a slot.
+ * With SIM_LOCKSTEP_CPUS they take turns in this order instead (see
+ * slot_turn_wait()) and print the same trace, at the cost of stepping
+ * one CPU at a time.
+ */
+static void run_des(struct os_instance * os) {
+	struct cpu_args * cpus = os->cpus;
+	struct loader_args * ld = &os->ld;
+	int ld_running = 1;
+	int cpu_running = os->num_cpus;
+	uint64_t wake;
+	int i;
+
+	trace(TRACE_EVENT, "ld_routine\n");
+	while (ld_running || cpu_running > 0) {
+		if (ld_running) {
+			/* Text goes straight out, only events are buffered */
+			trace_bind(&os->trace, NULL, &ld->timer_id->events, -1);
+			if (ld_step(ld, &wake)) {
+				detach_event(ld->timer_id);
+				ld_running = 0;
+			} else {
+				post_slot(ld->timer_id, wake);
+			}
+		}
+		for (i = 0; i < os->num_cpus; i++) {
+			if (cpus[i].stopped)
+				continue;
+			sched_bind_cpu(i);
+			trace_bind(&os->trace, NULL, &cpus[i].timer_id->events, i);
+			if (cpu_step(&cpus[i], &wake)) {
+				detach_event(cpus[i].timer_id);
+				cpus[i].stopped = 1;
+				cpu_running--;
+			} else {
+				post_slot(cpus[i].timer_id, wake);
+			}
+		}
 	}
-	free(ld_processes.path);
-	free(ld_processes.start_time);
-	done = 1;
-	detach_event(timer_id);
+	trace_bind(&os->trace, NULL, NULL, -1);
+}
+#else
+static void * cpu_routine(void * args) {
+	struct cpu_args * cpu = (struct cpu_args *)args;
+	uint64_t wake;
+
+	sched_bind_cpu(cpu->id);
+	trace_bind(&cpu->os->trace, &cpu->timer_id->trace,
+		&cpu->timer_id->events, cpu->id);
+	for (;;) {
+		slot_turn_wait(cpu->timer_id);
+		/* Check for new process in ready queue */
+		if (cpu_step(cpu, &wake))
+			break;
+		idle_slot(cpu->timer_id, wake);
+	}
+	detach_event(cpu->timer_id);
 	pthread_exit(NULL);
 }
 
-static void read_config(const char * path) {
+static void * ld_routine(void * args) {
+	struct loader_args * ld = (struct loader_args *)args;
+	uint64_t wake;
+
+	trace_bind(&ld->os->trace, &ld->timer_id->trace, &ld->timer_id->events, -1);
+	trace(TRACE_EVENT, "ld_routine\n");
+	for (;;) {
+		slot_turn_wait(ld->timer_id);
+		if (ld_step(ld, &wake))
+			break;
+		idle_slot(ld->timer_id, wake);
+	}
+	detach_event(ld->timer_id);
+	pthread_exit(NULL);
+}
+#endif
+
+static void free_ld_args(struct ld_args * procs, int num_processes) {
+	int i;
+	if (procs->path != NULL)
+		for (i = 0; i < num_processes; i++)
+			free(procs->path[i]);
+	free(procs->path);
+	free(procs->start_time);
+#ifdef MLQ_SCHED
+	free(procs->prio);
+#endif
+}
+
+static int read_config(struct os_instance * os, const char * path) {
+	struct ld_args * procs = &os->ld_processes;
 	FILE * file;
 	if ((file = fopen(path, "r")) == NULL) {
-		printf("Cannot find configure file at %s\n", path);
-		exit(1);
+		fprintf(trace_stream(&os->trace), "Cannot find configure file at %s\n", path);
+		return -1;
+	}
+	if (fscanf(file, "%d %d %d\n", &os->time_slot, &os->num_cpus,
+			&os->num_processes) != 3 || os->num_cpus <= 0
+			|| os->num_processes < 0) {
+		fprintf(trace_stream(&os->trace),
+			"Bad configure file header at %s\n", path);
+		fclose(file);
+		return -1;
 	}
-	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
-	ld_processes.path = (char**)malloc(sizeof(char*) * num_processes);
-	ld_processes.start_time = (unsigned long*)
-		malloc(sizeof(unsigned long) * num_processes);
+	procs->path = (char**)calloc(os->num_processes, sizeof(char*));
+	procs->start_time = (unsigned long*)
+		calloc(os->num_processes, sizeof(unsigned long));
 
 #ifdef CPU_TLB
 #ifdef CPUTLB_FIXED_TLBSZ
 	/* We provide here a back compatible with legacy OS simulatiom config file
 	 * In which, it have no addition config line for CPU_TLB
 	 */
-	tlbsz = 0x10000;
-	//tlbsz = 0xa0;
+	os->tlbsz = 0x10000;
+	//os->tlbsz = 0xa0;
 #else
 	/* Read input config of TLB size:
 	 * Format:
 	 *        CPU_TLBSZ
 	*/
-	fscanf(file, "%d\n", &tlbsz);
+	fscanf(file, "%d\n", &os->tlbsz);
 #endif
 #endif
 
@@ -191,95 +413,180 @@ static void read_config(const char * path) {
 	 * for legacy info 
 	 *  [time slice] [N = Number of CPU] [M = Number of Processes to be run]
 	 */
-	memramsz    =  0x100000;
-	memswpsz[0] = 0x1000000;
+	os->memramsz    =  0x100000;
+	os->memswpsz[0] = 0x1000000;
 	for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
-		memswpsz[sit] = 0;
+		os->memswpsz[sit] = 0;
 #else
 	/* Read input config of memory size: MEMRAM and upto 4 MEMSWP (mem swap)
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
 	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
 	*/
-	fscanf(file, "%d\n", &memramsz);
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		fscanf(file, "%d", &(memswpsz[sit])); 
-
-	fscanf(file, "\n"); /* Final character */
+	long mempos = ftell(file);
+	char memline[128];
+	int nmem = 0;
+	if (fgets(memline, sizeof(memline), file) != NULL)
+		nmem = sscanf(memline, "%d %d %d %d %d", &os->memramsz,
+			&os->memswpsz[0], &os->memswpsz[1],
+			&os->memswpsz[2], &os->memswpsz[3]);
+	if (nmem != 1 + PAGING_MAX_MMSWP) {
+		/* Legacy config without the line, use the fixed sizes */
+		fseek(file, mempos, SEEK_SET);
+		os->memramsz    =  0x100000;
+		os->memswpsz[0] = 0x1000000;
+		for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
+			os->memswpsz[sit] = 0;
+	}
 #endif
+
+	/* Optional line naming the page replacement policy, FIFO without it
+	 * Format:
+	 *        policy fifo|clock|aging
+	 */
+	char policy[16];
+	long pos = ftell(file);
+	os->policy = &pg_policy_fifo;
+	if (fscanf(file, "policy %15s\n", policy) != 1) {
+		fseek(file, pos, SEEK_SET); /* Not there, reread as a process */
+	} else if ((os->policy = pg_policy_by_name(policy)) == NULL) {
+		fprintf(trace_stream(&os->trace),
+			"Unknown page replacement policy %s\n", policy);
+		fclose(file);
+		return -1;
+	}
 #endif
 
 #ifdef MLQ_SCHED
-	ld_processes.prio = (unsigned long*)
-		malloc(sizeof(unsigned long) * num_processes);
+	procs->prio = (unsigned long*)
+		calloc(os->num_processes, sizeof(unsigned long));
 #endif
-	int i;
-	for (i = 0; i < num_processes; i++) {
-		ld_processes.path[i] = (char*)malloc(sizeof(char) * 100);
-		ld_processes.path[i][0] = '\0';
-		strcat(ld_processes.path[i], "input/proc/");
+	/* One process per line:
+	 *        START_TIME NAME [PRIO]
+	 * A missing priority is 0, a line that is not a process is skipped
+	 */
+	char line[256];
+	int i = 0;
+	while (i < os->num_processes && fgets(line, sizeof(line), file) != NULL) {
 		char proc[100];
+		unsigned long prio = 0;
+		if (sscanf(line, "%lu %99s %lu", &procs->start_time[i], proc,
+				&prio) < 2) {
+			if (strspn(line, " \t\r\n") != strlen(line))
+				fprintf(stderr, "%s: skipping line %s", path, line);
+			continue;
+		}
 #ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
-#else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
+		if (prio >= MAX_PRIO) {
+			fprintf(trace_stream(&os->trace),
+				"%s: priority %lu of %s is not below %d\n",
+				path, prio, proc, MAX_PRIO);
+			os->num_processes = i;
+			fclose(file);
+			return -1;
+		}
+		procs->prio[i] = prio;
 #endif
-		strcat(ld_processes.path[i], proc);
+		procs->path[i] = (char*)malloc(strlen("input/proc/") + strlen(proc) + 1);
+		sprintf(procs->path[i], "input/proc/%s", proc);
+		if (access(procs->path[i], R_OK) != 0) {
+			fprintf(trace_stream(&os->trace),
+				"Cannot find process description at '%s'\n",
+				procs->path[i]);
+			os->num_processes = i + 1;
+			fclose(file);
+			return -1;
+		}
+		i++;
+	}
+	if (i < os->num_processes) {
+		fprintf(stderr, "%s: %d of %d processes listed, running those\n",
+			path, i, os->num_processes);
+		os->num_processes = i;
 	}
+	fclose(file);
+	return 0;
 }
 
-int main(int argc, char * argv[]) {
+/* Set up a simulation of input/[config] tracing as [trace] says, NULL if
+ * the config is missing or malformed */
+static struct os_instance * os_create(const char * config,
+		const struct trace_ctx * trace) {
+	struct os_instance * os = calloc(1, sizeof(struct os_instance));
+	os->trace = *trace;
 	/* Read config */
-	if (argc != 2) {
-		printf("Usage: os [path to configure file]\n");
-		return 1;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "input/%s", config);
+	if (read_config(os, path) < 0) {
+		free_ld_args(&os->ld_processes, os->num_processes);
+		free(os);
+		return NULL;
 	}
-	char path[100];
-	path[0] = '\0';
-	strcat(path, "input/");
-	strcat(path, argv[1]);
-	read_config(path);
-
-	pthread_t * cpu = (pthread_t*)malloc(num_cpus * sizeof(pthread_t));
-	struct cpu_args * args =
-		(struct cpu_args*)malloc(sizeof(struct cpu_args) * num_cpus);
-	pthread_t ld;
+	os->avail_pid = 1;
+	os->progs = init_prog_cache();
+	init_timer(&os->timer, &os->trace);
+
+	os->cpus = (struct cpu_args*)malloc(sizeof(struct cpu_args) * os->num_cpus);
 	
 	/* Init timer */
 	int i;
-	for (i = 0; i < num_cpus; i++) {
-		args[i].timer_id = attach_event();
-		args[i].id = i;
+	/* The loader goes first, so each slot's trace shows the arrivals
+	 * before the CPUs, as run_des() steps them */
+	os->ld.timer_id = attach_event(&os->timer);
+#ifndef SIM_DES
+	/* A slot's arrivals reach the scheduler before any CPU dispatches */
+	os->ld.timer_id->ordered = 1;
+#endif
+	for (i = 0; i < os->num_cpus; i++) {
+		os->cpus[i].os = os;
+		os->cpus[i].timer_id = attach_event(&os->timer);
+#if !defined(SIM_DES) && defined(SIM_LOCKSTEP_CPUS)
+		/* CPU 0..n-1 after the loader, the order run_des() uses */
+		os->cpus[i].timer_id->ordered = 1;
+#endif
+		os->cpus[i].id = i;
+		os->cpus[i].proc = NULL;
+		os->cpus[i].time_left = 0;
+		os->cpus[i].stopped = 0;
 	}
-	struct timer_id_t * ld_event = attach_event();
-	start_timer();
+	os->ld.os = os;
+	os->ld.next = 0;
+	os->ld.ready = calloc(os->num_processes, sizeof(struct pcb_t *));
+	os->ld.next_parse = 0;
+	os->ld.stop = 0;
+	pthread_mutex_init(&os->ld.lock, NULL);
+	pthread_cond_init(&os->ld.parsed, NULL);
+	pthread_cond_init(&os->ld.space, NULL);
+	os->ld.workers = NULL;
+	os->ld.nr_workers = 0;
 #ifdef CPU_TLB
 
-	init_tlbmemphy(&tlb, tlbsz);
+	init_tlbmemphy(&os->tlb, os->tlbsz);
 #endif
 
 #ifdef MM_PAGING
 	/* Init all MEMPHY include 1 MEMRAM and n of MEMSWP */
 	int rdmflag = 1; /* By default memphy is RANDOM ACCESS MEMORY */
 
-	struct memphy_struct mram;
-	struct memphy_struct mswp[PAGING_MAX_MMSWP];
-
-
 	/* Create MEM RAM */
-	init_memphy(&mram, memramsz, rdmflag);
+	init_memphy(&os->mram, os->memramsz, rdmflag);
+	os->mram.policy = os->policy;
 
 	/* Create all MEM SWAP */ 
 	int sit;
+#ifdef MM_SEQ_SWAP
+	rdmflag = 0;
+#endif
 	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	       init_memphy(&os->mswp[sit], os->memswpsz[sit], rdmflag);
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
-	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
+	struct mmpaging_ld_args *mm_ld_args = &os->mm_ld_args;
 
-	mm_ld_args->timer_id = ld_event;
-	mm_ld_args->mram = (struct memphy_struct *) &mram;
-	mm_ld_args->mswp = (struct memphy_struct**) &mswp;
-	mm_ld_args->active_mswp = (struct memphy_struct *) &mswp[0];
+	mm_ld_args->timer_id = os->ld.timer_id;
+	mm_ld_args->mram = (struct memphy_struct *) &os->mram;
+	mm_ld_args->mswp = (struct memphy_struct**) &os->mswp;
+	mm_ld_args->active_mswp = (struct memphy_struct *) &os->mswp[0];
+	os->ld.mm = mm_ld_args;
 #endif
 
 #ifdef CPU_TLB
@@ -287,33 +594,314 @@ int main(int argc, char * argv[]) {
 	/* In MM_PAGING employ CPU_TLB mode, it needs passing
 	 * the system tlb to each PCB through loader
 	*/
-	mm_ld_args->tlb = (struct memphy_struct *) &tlb;
+	mm_ld_args->tlb = (struct memphy_struct *) &os->tlb;
 #endif
 #endif
 
 	/* Init scheduler */
-	init_scheduler();
+	os->sched = init_scheduler(os->num_cpus);
+
+	return os;
+}
+
+/* Run [os] to completion on the calling thread plus one per device */
+static void os_run(struct os_instance * os) {
+	trace_bind(&os->trace, NULL, NULL, -1);
+	start_timer(&os->timer);
 
 	/* Run CPU and loader */
-#ifdef MM_PAGING
-	pthread_create(&ld, NULL, ld_routine, (void*)mm_ld_args);
+#ifdef SIM_DES
+	run_des(os);
 #else
-	pthread_create(&ld, NULL, ld_routine, (void*)ld_event);
-#endif
-	for (i = 0; i < num_cpus; i++) {
+	pthread_t * cpu = (pthread_t*)malloc(os->num_cpus * sizeof(pthread_t));
+	pthread_t ld;
+	int i;
+
+	/* Prefetch workers go first, the first arrivals are usually due
+	 * at slot 0 */
+	os->ld.nr_workers = LD_PREFETCH_WORKERS;
+	if (os->ld.nr_workers > os->num_processes)
+		os->ld.nr_workers = os->num_processes;
+	os->ld.workers = malloc(os->ld.nr_workers * sizeof(pthread_t));
+	for (i = 0; i < os->ld.nr_workers; i++) {
+		pthread_create(&os->ld.workers[i], NULL,
+			ld_prefetch_routine, (void*)&os->ld);
+	}
+
+	pthread_create(&ld, NULL, ld_routine, (void*)&os->ld);
+	for (i = 0; i < os->num_cpus; i++) {
 		pthread_create(&cpu[i], NULL,
-			cpu_routine, (void*)&args[i]);
+			cpu_routine, (void*)&os->cpus[i]);
 	}
 
 	/* Wait for CPU and loader finishing */
-	for (i = 0; i < num_cpus; i++) {
+	for (i = 0; i < os->num_cpus; i++) {
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+
+	pthread_mutex_lock(&os->ld.lock);
+	os->ld.stop = 1;
+	pthread_cond_broadcast(&os->ld.space);
+	pthread_mutex_unlock(&os->ld.lock);
+	for (i = 0; i < os->ld.nr_workers; i++)
+		pthread_join(os->ld.workers[i], NULL);
+	free(cpu);
+#endif
 	/* Stop timer */
-	stop_timer();
+	stop_timer(&os->timer);
+
+#if defined(MM_PAGING) && defined(MM_SEQ_SWAP)
+	int sit;
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+		trace(TRACE_EVENT, "Swap %d: %lu seeks, seek cost %lu\n", sit,
+			os->mswp[sit].nr_seeks, os->mswp[sit].seek_cost);
+#endif
+	trace_bind(NULL, NULL, NULL, -1);
+}
+
+static void os_destroy(struct os_instance * os) {
+	int i;
+
+	finish_scheduler(os->sched);
+	free_prog_cache(os->progs);
+#ifdef MM_PAGING
+	free_memphy(&os->mram);
+	for (i = 0; i < PAGING_MAX_MMSWP; i++)
+		free_memphy(&os->mswp[i]);
+#endif
+#ifdef CPU_TLB
+	free_memphy(&os->tlb);
+#endif
+	free_ld_args(&os->ld_processes, os->num_processes);
+	free(os->ld.ready);
+	free(os->ld.workers);
+	pthread_mutex_destroy(&os->ld.lock);
+	pthread_cond_destroy(&os->ld.parsed);
+	pthread_cond_destroy(&os->ld.space);
+	free(os->cpus);
+	free(os);
+}
 
+/* Run the simulation described by input/[config] */
+static int simulate(const char * config, const struct trace_ctx * trace) {
+	struct os_instance * os = os_create(config, trace);
+	int ret;
+
+	if (os == NULL)
+		return 1;
+	os_run(os);
+	ret = os->failed;
+	os_destroy(os);
+	return ret;
+}
+
+/* Trace of one batch job: [level], text to output/[config].output and,
+ * with [evdir], events to [evdir]/[config].events. Return 0 on success */
+static int batch_trace_open(struct trace_ctx * trace, const char * config,
+		int level, const char * evdir) {
+	char path[PATH_MAX];
+	FILE * out;
+
+	snprintf(path, sizeof(path), "output/%s.output", config);
+	if ((out = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Cannot open output file %s\n", path);
+		return -1;
+	}
+	trace_ctx_init(trace, level, out);
+	if (evdir == NULL)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s.events", evdir, config);
+	if (trace_ev_open(trace, path) != 0) {
+		fprintf(stderr, "Cannot open event log %s\n", path);
+		fclose(out);
+		return -1;
+	}
 	return 0;
+}
 
+static void batch_trace_close(struct trace_ctx * trace) {
+	trace_ev_close(trace);
+	fclose(trace->out);
 }
 
+/* Shared by the jobs of a batch */
+struct batch_state {
+	pthread_mutex_t lock;
+	pthread_cond_t finished;	// Some job set its finished flag
+};
+
+/* One config of a batch and the thread simulating it */
+struct batch_job {
+	const char * config;
+	int level;
+	const char * evdir;
+	int ret;
+	int finished;		// 1 once simulated, 2 once reported
+	pthread_t thread;
+	struct batch_state * batch;
+};
+
+/* Simulate one batch job, see batch_trace_open() for where it traces to */
+static void * batch_routine(void * args) {
+	struct batch_job * job = (struct batch_job *)args;
+	struct os_instance * os;
+	struct trace_ctx trace;
+	int ret = 1;
+
+	/* Config errors go to stderr, the output file is only created for
+	 * a config that parsed */
+	trace_ctx_init(&trace, job->level, stderr);
+	os = os_create(job->config, &trace);
+	if (os != NULL) {
+		if (batch_trace_open(&os->trace, job->config, job->level,
+				job->evdir) == 0) {
+			os_run(os);
+			ret = os->failed;
+			batch_trace_close(&os->trace);
+		}
+		os_destroy(os);
+	}
+	pthread_mutex_lock(&job->batch->lock);
+	job->ret = ret;
+	job->finished = 1;
+	pthread_cond_signal(&job->batch->finished);
+	pthread_mutex_unlock(&job->batch->lock);
+	return NULL;
+}
+
+/*
+ * Batch mode: every argument is a config name or a glob of them under
+ * input/. Each simulation is an os_instance run by its own thread in
+ * this process, with at most [jobs] of them running at once.
+ */
+static int run_batch(int jobs, int level, const char * evdir,
+		int argc, char * argv[]) {
+	glob_t configs;
+	char pattern[PATH_MAX];
+	struct batch_state batch;
+	struct batch_job * job;
+	int flags = GLOB_MARK | GLOB_NOCHECK;
+	int nr_jobs = 0, nr_running = 0, nr_configs = 0, failed = 0;
+	size_t next = 0;
+	int i;
+
+	if (argc == 0) {
+		printf("No config given\n");
+		return 1;
+	}
+	for (i = 0; i < argc; i++) {
+		snprintf(pattern, sizeof(pattern), "input/%s", argv[i]);
+		glob(pattern, flags, NULL, &configs);
+		flags |= GLOB_APPEND;
+	}
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.finished, NULL);
+	job = calloc(configs.gl_pathc, sizeof(struct batch_job));
+	pthread_mutex_lock(&batch.lock);
+	while (next < configs.gl_pathc || nr_running > 0) {
+		if (next < configs.gl_pathc && nr_running < jobs) {
+			/* Strip the input/ prefix back off */
+			const char * config = configs.gl_pathv[next++] + strlen("input/");
+			if (config[strlen(config) - 1] == '/')
+				continue; /* GLOB_MARK flags directories */
+			nr_configs++;
+			job[nr_jobs].config = config;
+			job[nr_jobs].level = level;
+			job[nr_jobs].evdir = evdir;
+			job[nr_jobs].batch = &batch;
+			if (pthread_create(&job[nr_jobs].thread, NULL,
+					batch_routine, &job[nr_jobs]) != 0) {
+				printf("Cannot start %s\n", config);
+				failed++;
+				continue;
+			}
+			nr_jobs++;
+			nr_running++;
+			continue;
+		}
+
+		pthread_cond_wait(&batch.finished, &batch.lock);
+		for (i = 0; i < nr_jobs; i++) {
+			if (job[i].finished != 1)
+				continue;
+			job[i].finished = 2;	/* Reported */
+			nr_running--;
+			pthread_join(job[i].thread, NULL);
+			if (job[i].ret == 0) {
+				printf("%s: done\n", job[i].config);
+			} else {
+				printf("%s: failed\n", job[i].config);
+				failed++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	printf("Batch done: %d configs, %d failed\n", nr_configs, failed);
+	free(job);
+	pthread_cond_destroy(&batch.finished);
+	pthread_mutex_destroy(&batch.lock);
+	globfree(&configs);
+	return failed != 0;
+}
+
+static void usage(void) {
+	printf("Usage: os [-v level] [-e event log] [path to configure file]\n");
+	printf("       os -b [-j jobs] [-v level] [-e dir] [config or glob under input/]...\n");
+	printf("Trace levels: 0 none, 1 scheduling events, 2 memory instructions,\n");
+	printf("              3 page table and memory dumps (default %d)\n",
+		TRACE_MAX_LEVEL);
+	printf("-e logs binary events for tracedump, batch jobs log to\n");
+	printf("   <dir>/<config>.events\n");
+}
+
+int main(int argc, char * argv[]) {
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int level = TRACE_MAX_LEVEL;
+	struct trace_ctx trace;
+	const char * events = NULL;
+	int batch = 0;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "bj:e:v:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'e':
+			events = optarg;
+			break;
+		case 'v':
+			level = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (batch) {
+		/* Batch: os -b [-j N] config... */
+		if (jobs < 1)
+			jobs = 1;
+		return run_batch(jobs, level, events, argc - optind, argv + optind);
+	}
+
+	if (argc - optind != 1) {
+		usage();
+		return 1;
+	}
+	trace_ctx_init(&trace, level, NULL);
+	if (events != NULL && trace_ev_open(&trace, events) != 0) {
+		printf("Cannot open event log %s\n", events);
+		return 1;
+	}
+	ret = simulate(argv[optind], &trace);
+	trace_ev_close(&trace);
+	return ret;
+}
@@ -5,8 +5,8 @@
 #include <stdio.h>
 
 int main() {
-	struct pcb_t * ld = load("input/p0");
-	struct pcb_t * proc = load("input/p0");
+	struct pcb_t * ld = load(NULL, "input/p0", 1);
+	struct pcb_t * proc = load(NULL, "input/p0", 2);
 	unsigned int i;
 	for (i = 0; i < proc->code->size; i++) {
 		run(proc);
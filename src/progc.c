@@ -0,0 +1,48 @@
+
+#include "loader.h"
+
+#include <stdio.h>
+
+/*
+ * Program compiler: turns a text process description into the binary
+ * format load() maps in place, see struct prog_header.
+ * Usage: progc <text program> <compiled program>
+ */
+
+int main(int argc, char * argv[]) {
+	struct prog_header hdr;
+	struct pcb_t * proc;
+	FILE * out;
+
+	if (argc != 3) {
+		printf("Usage: progc [text program] [compiled program]\n");
+		return 1;
+	}
+
+	proc = load(NULL, argv[1], 0);
+	if (proc == NULL)
+		return 1;
+	if (proc->code->map != NULL) {
+		printf("%s is already compiled\n", argv[1]);
+		return 1;
+	}
+
+	hdr.magic = PROG_MAGIC;
+	hdr.version = PROG_VERSION;
+	hdr.priority = proc->priority;
+	hdr.size = proc->code->size;
+
+	if ((out = fopen(argv[2], "wb")) == NULL) {
+		printf("Cannot create %s\n", argv[2]);
+		return 1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+			fwrite(proc->code->text, sizeof(struct inst_t),
+				hdr.size, out) != hdr.size) {
+		printf("Cannot write %s\n", argv[2]);
+		fclose(out);
+		return 1;
+	}
+	fclose(out);
+	return 0;
+}
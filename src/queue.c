@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "queue.h"
 
 int empty(struct queue_t * q) {
@@ -7,15 +8,26 @@ int empty(struct queue_t * q) {
 	return (q->size == 0);
 }
 
+/* Double the ring and unwrap the entries that sat before [head] */
+static void grow_queue(struct queue_t * q) {
+        uint32_t cap = q->cap ? q->cap * 2 : QUEUE_INIT_SIZE;
+
+        q->proc = realloc(q->proc, sizeof(struct pcb_t *) * cap);
+        if (q->head + q->size > q->cap) {
+                uint32_t wrapped = q->head + q->size - q->cap;
+                memcpy(&q->proc[q->cap], &q->proc[0],
+                        sizeof(struct pcb_t *) * wrapped);
+        }
+        q->cap = cap;
+}
+
 void enqueue(struct queue_t * q, struct pcb_t * proc) {
         /* TODO: put a new process to queue [q] */ // DONE
         if (q == NULL || proc == NULL) return;
-        if (q->size >= MAX_QUEUE_SIZE)
-        {
-                printf("Queue is full\n");
-                return;
-        }
-        q->proc[q->size++] = proc;
+        if ((uint32_t)q->size == q->cap)
+                grow_queue(q);
+        q->proc[(q->head + q->size) & (q->cap - 1)] = proc;
+        q->size++;
 }
 
 struct pcb_t * dequeue(struct queue_t * q) {
@@ -23,13 +35,18 @@ struct pcb_t * dequeue(struct queue_t * q) {
          * in the queue [q] and remember to remove it from q
          * */ // DONE
         if (q == NULL || q->size == 0) return NULL;
-        struct pcb_t *proc = q->proc[0];
+        struct pcb_t *proc = q->proc[q->head];
+        q->head = (q->head + 1) & (q->cap - 1);
         q->size--;
-        for(int i = 0; i < q->size; i++)
-        {
-                q->proc[i] = q->proc[i+1];
-        }
 	return proc;
 }
 
+void free_queue(struct queue_t * q) {
+        if (q == NULL) return;
+        free(q->proc);
+        q->proc = NULL;
+        q->head = 0;
+        q->cap = 0;
+        q->size = 0;
+}
 
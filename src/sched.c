@@ -1,40 +1,107 @@
 
 #include "queue.h"
 #include "sched.h"
+#include "loader.h"
 #include "mm.h"
+#include "bitops.h"
+#include "trace.h"
 #include <pthread.h>
 
 #include <stdlib.h>
 #include <stdio.h>
-static struct queue_t ready_queue;
-static struct queue_t run_queue;
-static pthread_mutex_t queue_lock;
 
 #ifdef MLQ_SCHED
-static struct queue_t mlq_ready_queue[MAX_PRIO];
+/* A set of MLQ ready queues. All CPUs share rqs[0] by default, with
+ * SCHED_PERCPU every CPU owns rqs[cpu] and steals from its peers */
+struct mlq_rq {
+	pthread_mutex_t lock;
+	struct queue_t queue[MAX_PRIO];
+	/* Bit [prio] is set while queue[prio] holds a process */
+	unsigned long ready_map[BITS_TO_LONGS(MAX_PRIO)];
+	int nr_ready;	// Read locklessly by stealing CPUs
+	/* Admission queue: a lock-free stack of new PCBs linked through
+	 * admit_next. The loader pushes with CAS, the CPU owning the queue
+	 * detaches the whole batch with one exchange before dispatching */
+	struct pcb_t * admit_head;
+};
+
+struct sched_struct {
+	struct mlq_rq * rqs;
+	int nr_rqs;
+	/* Arrivals so far, new processes go to rqs[nr_admitted % nr_rqs] */
+	unsigned int nr_admitted;
+	struct queue_t ready_queue;
+	struct queue_t run_queue;
+	pthread_mutex_t queue_lock;
+};
+
+/* CPU the calling thread plays, threads never move between instances */
+static __thread int this_cpu;
+
+#ifdef SCHED_PERCPU
+#define local_rq(sched)	(&(sched)->rqs[this_cpu % (sched)->nr_rqs])
+#else
+#define local_rq(sched)	(&(sched)->rqs[0])
+#endif
+#else
+struct sched_struct {
+	struct queue_t ready_queue;
+	struct queue_t run_queue;
+	pthread_mutex_t queue_lock;
+};
 #endif
 
-int queue_empty(void) {
+int queue_empty(struct sched_struct * sched) {
 #ifdef MLQ_SCHED
-	unsigned long prio;
-	for (prio = 0; prio < MAX_PRIO; prio++)
-		if(!empty(&mlq_ready_queue[prio])) 
+	int i;
+	for (i = 0; i < sched->nr_rqs; i++) {
+		if (__atomic_load_n(&sched->rqs[i].admit_head, __ATOMIC_ACQUIRE) != NULL)
+			return -1;
+		if (find_first_bit(sched->rqs[i].ready_map, MAX_PRIO) < MAX_PRIO)
 			return -1;
+	}
 #endif
-	return (empty(&ready_queue) && empty(&run_queue));
+	return (empty(&sched->ready_queue) && empty(&sched->run_queue));
 }
 
-void init_scheduler(void) {
+struct sched_struct * init_scheduler(int num_cpus) {
+	struct sched_struct * sched = calloc(1, sizeof(struct sched_struct));
 #ifdef MLQ_SCHED
 	int i ;
 
-	for (i = 0; i < MAX_PRIO; i ++)
-		mlq_ready_queue[i].size = 0;
+#ifdef SCHED_PERCPU
+	sched->nr_rqs = num_cpus > 0 ? num_cpus : 1;
+#else
+	sched->nr_rqs = 1;
+#endif
+	sched->rqs = calloc(sched->nr_rqs, sizeof(struct mlq_rq));
+	for (i = 0; i < sched->nr_rqs; i++)
+		pthread_mutex_init(&sched->rqs[i].lock, NULL);
+#endif
+	sched->run_queue.slot = MAX_PRIO;
+	pthread_mutex_init(&sched->queue_lock, NULL);
+	return sched;
+}
+
+void finish_scheduler(struct sched_struct * sched) {
+#ifdef MLQ_SCHED
+	int i, prio;
+
+	for (i = 0; i < sched->nr_rqs; i++) {
+		for (prio = 0; prio < MAX_PRIO; prio++)
+			free_queue(&sched->rqs[i].queue[prio]);
+		pthread_mutex_destroy(&sched->rqs[i].lock);
+	}
+	free(sched->rqs);
 #endif
-	ready_queue.size = 0;
-	run_queue.size = 0;
-	run_queue.slot = MAX_PRIO;
-	pthread_mutex_init(&queue_lock, NULL);
+	free_queue(&sched->ready_queue);
+	free_queue(&sched->run_queue);
+	pthread_mutex_destroy(&sched->queue_lock);
+	free(sched);
+}
+
+void sched_bind_cpu(int cpu) {
+	this_cpu = cpu;
 }
 
 #ifdef MLQ_SCHED
@@ -44,100 +111,227 @@ void init_scheduler(void) {
  *  We implement stateful here using transition technique
  *  State representation   prio = 0 .. MAX_PRIO, curr_slot = 0..(MAX_PRIO - prio)
  */
-struct pcb_t * get_mlq_proc(void) {
+
+/* Queue [proc] on its priority level and mark the level as ready.
+ * Caller holds rq->lock */
+static void mlq_enqueue(struct mlq_rq * rq, struct pcb_t * proc) {
+	enqueue(&rq->queue[proc->prio], proc);
+	set_bit(proc->prio, rq->ready_map);
+	__atomic_store_n(&rq->nr_ready, rq->nr_ready + 1, __ATOMIC_RELAXED);
+}
+
+/* Pop from the highest non-empty priority level, found by the first
+ * set bit of ready_map. Caller holds rq->lock */
+static struct pcb_t * mlq_dequeue(struct mlq_rq * rq) {
+	int prio = find_first_bit(rq->ready_map, MAX_PRIO);
+	struct pcb_t * proc;
+
+	if (prio >= MAX_PRIO)
+		return NULL;
+
+	proc = dequeue(&rq->queue[prio]);
+	if (proc != NULL) rq->queue[prio].slot--;
+	if (empty(&rq->queue[prio]))
+		clear_bit(prio, rq->ready_map);
+	__atomic_store_n(&rq->nr_ready, rq->nr_ready - 1, __ATOMIC_RELAXED);
+
+	return proc;
+}
+
+#ifdef SCHED_PERCPU
+/* Take the highest priority process of the peer holding the most ready
+ * processes. Loads are only compared locklessly, the pop is locked */
+static struct pcb_t * steal_mlq_proc(struct sched_struct * sched,
+		struct mlq_rq * self) {
+	struct mlq_rq * busiest = NULL;
+	struct pcb_t * proc = NULL;
+	int i, nr, max = 0;
+
+	for (i = 0; i < sched->nr_rqs; i++) {
+		if (&sched->rqs[i] == self)
+			continue;
+		nr = __atomic_load_n(&sched->rqs[i].nr_ready, __ATOMIC_RELAXED);
+		if (nr > max) {
+			max = nr;
+			busiest = &sched->rqs[i];
+		}
+	}
+	if (busiest == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&busiest->lock);
+	proc = mlq_dequeue(busiest);
+	pthread_mutex_unlock(&busiest->lock);
+
+	return proc;
+}
+#endif
+
+/* Move every process admitted to [rq] into it. Caller holds rq->lock */
+static void mlq_admit(struct mlq_rq * rq) {
+	struct pcb_t * batch, * fifo = NULL, * next;
+
+	if (__atomic_load_n(&rq->admit_head, __ATOMIC_RELAXED) == NULL)
+		return;
+	batch = __atomic_exchange_n(&rq->admit_head, NULL, __ATOMIC_ACQUIRE);
+
+	/* The stack holds the newest arrival first, restore arrival order */
+	while (batch != NULL) {
+		next = batch->admit_next;
+		batch->admit_next = fifo;
+		fifo = batch;
+		batch = next;
+	}
+	while (fifo != NULL) {
+		next = fifo->admit_next;
+		fifo->admit_next = NULL;
+		mlq_enqueue(rq, fifo);
+		fifo = next;
+	}
+}
+
+struct pcb_t * get_mlq_proc(struct sched_struct * sched) {
+	struct mlq_rq * rq = local_rq(sched);
 	struct pcb_t * proc = NULL;
 	/*TODO: get a process from PRIORITY [ready_queue].
 	 * Remember to use lock to protect the queue.
 	 */ // DONE
-	pthread_mutex_lock(&queue_lock);
-	for (int i = 0; i < MAX_PRIO; i++)
-	{
-		if (!empty(&mlq_ready_queue[i]))
-		{
-			proc = dequeue(&mlq_ready_queue[i]);
-			if (proc != NULL) mlq_ready_queue[i].slot--;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&queue_lock);
+	pthread_mutex_lock(&rq->lock);
+	mlq_admit(rq);
+	proc = mlq_dequeue(rq);
+	pthread_mutex_unlock(&rq->lock);
+#ifdef SCHED_PERCPU
+	if (proc == NULL)
+		proc = steal_mlq_proc(sched, rq);
+#endif
 
 	return proc;	
 }
 
-void put_mlq_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-	mlq_ready_queue[proc->prio].slot++;
-	pthread_mutex_unlock(&queue_lock);
+void put_mlq_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	struct mlq_rq * rq = local_rq(sched);
+
+	pthread_mutex_lock(&rq->lock);
+	mlq_enqueue(rq, proc);
+	rq->queue[proc->prio].slot++;
+	pthread_mutex_unlock(&rq->lock);
 }
 
-void add_mlq_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-		pthread_mutex_unlock(&queue_lock);	
+void add_mlq_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	/* Spread arrivals over the ready queues round-robin, so one CPU
+	 * admitting does not take a whole burst onto its own queue. Never
+	 * blocks on the ready queues, the owner of the queue picks the
+	 * process up when it next dispatches */
+	unsigned int n = __atomic_fetch_add(&sched->nr_admitted, 1,
+			__ATOMIC_RELAXED);
+	struct mlq_rq * rq = &sched->rqs[n % sched->nr_rqs];
+
+	proc->admit_next = __atomic_load_n(&rq->admit_head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rq->admit_head, &proc->admit_next,
+			proc, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-struct pcb_t * get_proc(void) {
-	return get_mlq_proc();
+struct pcb_t * get_proc(struct sched_struct * sched) {
+	struct pcb_t * proc = get_mlq_proc(sched);
+
+	if (proc != NULL)
+		trace_ev(EV_DISPATCH, proc->pid, 0, 0);
+	return proc;
 }
 
-void put_proc(struct pcb_t * proc) {
-	return put_mlq_proc(proc);
+void put_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	trace_ev(EV_PREEMPT, proc->pid, 0, 0);
+	put_mlq_proc(sched, proc);
 }
 
-void add_proc(struct pcb_t * proc) {
-	return add_mlq_proc(proc);
+void add_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	return add_mlq_proc(sched, proc);
 }
 
-void end_proc(struct pcb_t **proc)
+void end_proc(struct sched_struct * sched, struct pcb_t **proc)
 {
-	pthread_mutex_lock(&queue_lock);
-	mlq_ready_queue[(*proc)->prio].slot++;
+	struct mlq_rq * rq = local_rq(sched);
+
+	trace_ev(EV_FINISH, (*proc)->pid, 0, 0);
+	pthread_mutex_lock(&rq->lock);
+	rq->queue[(*proc)->prio].slot++;
+	pthread_mutex_unlock(&rq->lock);
+
 #ifdef CPU_TLB
+	/* The frame table, free stack and fifo chain change under the RAM
+	 * lock, the same one the fault and allocation paths hold. The swap
+	 * lock nests inside it */
+	struct memphy_struct * mram = (*proc)->mram;
+	struct memphy_struct * mswp = (*proc)->active_mswp;
+
+	pthread_mutex_lock(&mram->lock);
+	pthread_mutex_lock(&mswp->lock);
 	tlb_flush_tlb_of((*proc), (*proc)->tlb);
 	struct vm_area_struct *vma = get_vma_by_num((*proc)->mm, 0);
 	int pg_start = vma->vm_start, pg_end = (vma->vm_end - 1) / PAGING_PAGESZ;
 
-	for (int i = pg_start; i < pg_end; i++)
+	for (int i = pg_start; i <= pg_end; i++)
 	{
-		int pte = (*proc)->mm->pgd[i];
-		if (PAGING_PAGE_PRESENT(pte))
-		{
-			int fpn = PAGING_FPN(pte);
-			MEMPHY_free_frame((*proc)->mram, fpn);
+		uint32_t pte = (*proc)->mm->pgd[i];
+		struct memphy_struct * mp;
+		struct frame_entry * fe;
+		int fpn;
+
+		if (pte & PAGING_PTE_SWAPPED_MASK) {
+			mp = mswp;
+			fpn = PAGING_SWP(pte);
+		} else if (PAGING_PAGE_PRESENT(pte)) {
+			mp = mram;
+			fpn = PAGING_PTE_FPN(pte);
+		} else {
+			continue;
 		}
-		else
-		{
-			int fpn = PAGING_SWP(pte);
-			MEMPHY_free_frame((*proc)->active_mswp, fpn);
+		/* Only give back a frame the table says still holds this page */
+		fe = MEMPHY_frame(mp, fpn);
+		if (fe == NULL || fe->owner != (*proc)->mm || fe->pgn != i)
+			continue;
+		/* An online page may also keep a copy on swap */
+		if (mp == mram && fe->swpfpn >= 0) {
+			struct frame_entry * swp = MEMPHY_frame(mswp, fe->swpfpn);
+			if (swp != NULL && swp->owner == (*proc)->mm && swp->pgn == i)
+				MEMPHY_free_frame(mswp, fe->swpfpn);
 		}
+		MEMPHY_free_frame(mp, fpn);
 	}
+	pthread_mutex_unlock(&mswp->lock);
+	pthread_mutex_unlock(&mram->lock);
+	/* No frame names the mm any more */
+	free_mm((*proc)->mm);
 #endif
-	pthread_mutex_unlock(&queue_lock);
+	release_code((*proc)->code);
+	free((*proc)->page_table);
 	free(*proc);
 }
 #else
-struct pcb_t * get_proc(void) {
+struct pcb_t * get_proc(struct sched_struct * sched) {
 	struct pcb_t * proc = NULL;
 	/*TODO: get a process from [ready_queue].
 	 * Remember to use lock to protect the queue.
 	 * */ // DONE
-	pthread_mutex_lock(&queue_lock);
-	if (!empty(&ready_queue)) proc = dequeue(&ready_queue);
-	pthread_mutex_unlock(&queue_lock);
+	pthread_mutex_lock(&sched->queue_lock);
+	if (!empty(&sched->ready_queue)) proc = dequeue(&sched->ready_queue);
+	pthread_mutex_unlock(&sched->queue_lock);
+	if (proc != NULL)
+		trace_ev(EV_DISPATCH, proc->pid, 0, 0);
 	return proc;
 }
 
-void put_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&run_queue, proc);
-	pthread_mutex_unlock(&queue_lock);
+void put_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	trace_ev(EV_PREEMPT, proc->pid, 0, 0);
+	pthread_mutex_lock(&sched->queue_lock);
+	enqueue(&sched->run_queue, proc);
+	pthread_mutex_unlock(&sched->queue_lock);
 }
 
-void add_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&ready_queue, proc);
-	pthread_mutex_unlock(&queue_lock);	
+void add_proc(struct sched_struct * sched, struct pcb_t * proc) {
+	pthread_mutex_lock(&sched->queue_lock);
+	enqueue(&sched->ready_queue, proc);
+	pthread_mutex_unlock(&sched->queue_lock);	
 }
 #endif
 
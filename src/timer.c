@@ -1,136 +1,257 @@
 
 #include "timer.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
-
-static pthread_t _timer;
+#include <sched.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 struct timer_id_container_t {
 	struct timer_id_t id;
 	struct timer_id_container_t * next;
 };
 
-static struct timer_id_container_t * dev_list = NULL;
-
-static uint64_t _time;
-
-static int timer_started = 0;
-static int timer_stop = 0;
-
-
-static void * timer_routine(void * args) {
-	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
-		/* Wait for all devices have done the job in current
-		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
-		}
+#define SLOT_DEV	(1ULL << 32)
+#define SLOT_PENDING(b)	((uint32_t)(b))
+#define SLOT_TOTAL(b)	((uint32_t)((b) >> 32))
 
-		/* Increase the time slot */
-		_time++;
-		
-		/* Let devices continue their job */
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
-		}
-		if (fsh == event) {
-			break;
+/* Polls of seq before a waiter sleeps in the kernel */
+#define SLOT_SPIN	256
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	do { } while (0)
+#endif
+
+static void slot_sleep(uint32_t * addr, uint32_t val) {
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+	sched_yield();
+#endif
+}
+
+static void slot_wake(uint32_t * addr) {
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Wait until timer->seq moves past [seq] */
+static void slot_wait(struct timer_struct * timer, uint32_t seq) {
+	int spin;
+
+	for (spin = 0; spin < SLOT_SPIN; spin++) {
+		if (__atomic_load_n(&timer->seq, __ATOMIC_ACQUIRE) != seq)
+			return;
+		cpu_relax();
+	}
+	while (__atomic_load_n(&timer->seq, __ATOMIC_ACQUIRE) == seq)
+		slot_sleep(&timer->seq, seq);
+}
+
+/* First ordered device still attached at or after [dev], NULL if none */
+static struct timer_id_container_t * turn_from(struct timer_id_container_t * dev) {
+	while (dev != NULL && (dev->id.fsh || !dev->id.ordered))
+		dev = dev->next;
+	return dev;
+}
+
+/* Hand the turn to [dev] and wake the devices waiting for it */
+static void turn_set(struct timer_struct * timer, struct timer_id_container_t * dev) {
+	if (__atomic_load_n(&timer->turn, __ATOMIC_RELAXED) == dev)
+		return;
+	__atomic_store_n(&timer->turn, dev, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&timer->turn_seq, 1, __ATOMIC_RELEASE);
+	slot_wake(&timer->turn_seq);
+}
+
+/* [timer_id] is done stepping in this slot, pass the turn on if it held it */
+static void turn_pass(struct timer_id_t * timer_id) {
+	struct timer_struct * timer = timer_id->timer;
+	/* id is the first member of its container */
+	struct timer_id_container_t * dev = (struct timer_id_container_t *)timer_id;
+
+	if (__atomic_load_n(&timer->turn, __ATOMIC_ACQUIRE) == dev)
+		turn_set(timer, turn_from(dev->next));
+}
+
+void slot_turn_wait(struct timer_id_t * timer_id) {
+	struct timer_struct * timer = timer_id->timer;
+	struct timer_id_container_t * dev = (struct timer_id_container_t *)timer_id;
+	struct timer_id_container_t * want = timer_id->ordered ? dev : NULL;
+	uint32_t seq;
+	int spin = 0;
+
+	for (;;) {
+		seq = __atomic_load_n(&timer->turn_seq, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&timer->turn, __ATOMIC_ACQUIRE) == want)
+			return;
+		if (spin < SLOT_SPIN) {
+			spin++;
+			cpu_relax();
+		} else {
+			slot_sleep(&timer->turn_seq, seq);
 		}
 	}
-	pthread_exit(args);
 }
 
-void next_slot(struct timer_id_t * timer_id) {
+/* Every attached device has arrived: move to the next time slot and
+ * release them. Nobody else touches the barrier until seq moves */
+static void slot_advance(struct timer_struct * timer) {
+	uint32_t total = SLOT_TOTAL(__atomic_load_n(&timer->barrier, __ATOMIC_ACQUIRE));
+	uint64_t next = timer->time + 1;
+	struct timer_id_container_t * dev;
+
+	/* Every device is parked, write out what they traced in the slot */
+	for (dev = timer->dev_list; dev != NULL; dev = dev->next) {
+		trace_flush(timer->trace, &dev->id.trace);
+		trace_ev_flush(timer->trace, &dev->id.events, timer->time);
+	}
+
+#ifdef TIMER_FASTFWD
+	/* Every device is idle until [wake_min], skip the empty slots */
+	if (total != 0 && timer->wake_min != TIMER_NEVER && timer->wake_min > next)
+		next = timer->wake_min;
+	timer->wake_min = TIMER_NEVER;
+#endif
+
+	/* Increase the time slot */
+	__atomic_store_n(&timer->time, next, __ATOMIC_RELAXED);
+	/* The ordered devices go first again */
+	turn_set(timer, turn_from(timer->dev_list));
+	/* Nothing more to announce once the last device left */
+	if (total != 0) {
+		/* Straight out, this thread's buffer was just flushed */
+		if (trace_ctx_on(timer->trace, TRACE_EVENT))
+			fprintf(trace_stream(timer->trace), "Time slot %3lu\n",
+				current_time(timer));
+		__atomic_store_n(&timer->barrier, (uint64_t)total * SLOT_DEV + total,
+			__ATOMIC_RELAXED);
+	}
+
+	/* Let devices continue their job */
+	__atomic_add_fetch(&timer->seq, 1, __ATOMIC_RELEASE);
+	slot_wake(&timer->seq);
+}
+
+/* Arrive at the barrier. Return 1 if that completed the slot */
+static int slot_arrive(struct timer_id_t * timer_id, uint64_t wake) {
+	struct timer_struct * timer = timer_id->timer;
+#ifdef TIMER_FASTFWD
+	uint64_t cur = __atomic_load_n(&timer->wake_min, __ATOMIC_RELAXED);
+	while (wake < cur && !__atomic_compare_exchange_n(&timer->wake_min, &cur,
+			wake, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+
 	/* Tell to timer that we have done our job in current slot */
-	pthread_mutex_lock(&timer_id->event_lock);
 	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
-
-	/* Wait for going to next slot */
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+	turn_pass(timer_id);
+	if (SLOT_PENDING(__atomic_sub_fetch(&timer->barrier, 1, __ATOMIC_ACQ_REL)) == 0) {
+		slot_advance(timer);
+		return 1;
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+	return 0;
+}
+
+void idle_slot(struct timer_id_t * timer_id, uint64_t wake) {
+	uint32_t seq = __atomic_load_n(&timer_id->timer->seq, __ATOMIC_ACQUIRE);
+
+	if (!slot_arrive(timer_id, wake))
+		/* Wait for going to next slot */
+		slot_wait(timer_id->timer, seq);
+	timer_id->done = 0;
 }
 
-uint64_t current_time() {
-	return _time;
+void post_slot(struct timer_id_t * timer_id, uint64_t wake) {
+	slot_arrive(timer_id, wake);
+	timer_id->done = 0;
 }
 
-void start_timer() {
-	timer_started = 1;
-	pthread_create(&_timer, NULL, timer_routine, NULL);
+void next_slot(struct timer_id_t * timer_id) {
+	idle_slot(timer_id, current_time(timer_id->timer) + 1);
+}
+
+uint64_t current_time(struct timer_struct * timer) {
+	return __atomic_load_n(&timer->time, __ATOMIC_RELAXED);
+}
+
+void init_timer(struct timer_struct * timer, struct trace_ctx * trace) {
+	timer->dev_list = NULL;
+	timer->trace = trace;
+	timer->time = 0;
+	timer->started = 0;
+	timer->barrier = 0;
+	timer->seq = 0;
+	timer->wake_min = TIMER_NEVER;
+	timer->turn = NULL;
+	timer->turn_seq = 0;
+}
+
+void start_timer(struct timer_struct * timer) {
+	/* Slots advance on the devices themselves, no timer thread needed */
+	timer->started = 1;
+	timer->turn = turn_from(timer->dev_list);
+	if (trace_ctx_on(timer->trace, TRACE_EVENT))
+		fprintf(trace_stream(timer->trace), "Time slot %3lu\n",
+			current_time(timer));
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
+	struct timer_struct * timer = event->timer;
+
+	turn_pass(event);
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+	/* Leave the barrier, counting as this slot's arrival */
+	if (SLOT_PENDING(__atomic_sub_fetch(&timer->barrier, SLOT_DEV + 1,
+			__ATOMIC_ACQ_REL)) == 0)
+		slot_advance(timer);
 }
 
-struct timer_id_t * attach_event() {
-	if (timer_started) {
+struct timer_id_t * attach_event(struct timer_struct * timer) {
+	if (timer->started) {
 		return NULL;
 	}else{
 		struct timer_id_container_t * container =
 			(struct timer_id_container_t*)malloc(
 				sizeof(struct timer_id_container_t)		
 			);
+		struct timer_id_container_t ** tail = &timer->dev_list;
 		container->id.done = 0;
 		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, NULL);
-		pthread_mutex_init(&container->id.event_lock, NULL);
-		pthread_cond_init(&container->id.timer_cond, NULL);
-		pthread_mutex_init(&container->id.timer_lock, NULL);
-		if (dev_list == NULL) {
-			dev_list = container;
-			dev_list->next = NULL;
-		}else{
-			container->next = dev_list;
-			dev_list = container;
-		}
+		container->id.ordered = 0;
+		container->id.timer = timer;
+		container->id.trace.data = NULL;
+		container->id.trace.len = 0;
+		container->id.trace.cap = 0;
+		container->id.events.data = NULL;
+		container->id.events.len = 0;
+		container->id.events.cap = 0;
+		container->next = NULL;
+		timer->barrier += SLOT_DEV + 1;
+		/* Keep attach order, traces are written out in it */
+		while (*tail != NULL)
+			tail = &(*tail)->next;
+		*tail = container;
 		return &(container->id);
 	}
 }
 
-void stop_timer() {
-	timer_stop = 1;
-	pthread_join(_timer, NULL);
-	while (dev_list != NULL) {
-		struct timer_id_container_t * temp = dev_list;
-		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
+void stop_timer(struct timer_struct * timer) {
+	while (timer->dev_list != NULL) {
+		struct timer_id_container_t * temp = timer->dev_list;
+		timer->dev_list = timer->dev_list->next;
+		trace_flush(timer->trace, &temp->id.trace);
+		trace_ev_flush(timer->trace, &temp->id.events, timer->time);
+		trace_free(&temp->id.trace);
+		trace_free(&temp->id.events);
 		free(temp);
 	}
+	/* Ready for another run */
+	init_timer(timer, timer->trace);
 }
-
-
-
-
@@ -0,0 +1,141 @@
+
+#include "trace.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_BUF_INIT	4096
+
+/* Threads that bound no context trace everything to stdout. Nothing
+ * writes it, so it is not state shared between instances */
+static struct trace_ctx trace_default = { TRACE_MAX_LEVEL, NULL, NULL };
+
+__thread struct trace_ctx * trace_ctx_cur = &trace_default;
+static __thread struct trace_buf * trace_cur;
+static __thread struct trace_buf * trace_ev_cur;
+static __thread int trace_cpu = -1;
+
+void trace_ctx_init(struct trace_ctx * ctx, int level, FILE * out) {
+	ctx->level = level;
+	ctx->out = out;
+	ctx->evfile = NULL;
+}
+
+FILE * trace_stream(struct trace_ctx * ctx) {
+	return ctx->out != NULL ? ctx->out : stdout;
+}
+
+void trace_bind(struct trace_ctx * ctx, struct trace_buf * buf,
+		struct trace_buf * events, int cpu) {
+	trace_ctx_cur = ctx != NULL ? ctx : &trace_default;
+	trace_cur = buf;
+	trace_ev_cur = events;
+	trace_cpu = cpu;
+}
+
+/* Make room for [n] more bytes and the terminating NUL */
+static void trace_reserve(struct trace_buf * buf, size_t n) {
+	size_t cap = buf->cap ? buf->cap : TRACE_BUF_INIT;
+
+	while (cap < buf->len + n + 1)
+		cap *= 2;
+	if (cap != buf->cap) {
+		buf->data = realloc(buf->data, cap);
+		buf->cap = cap;
+	}
+}
+
+void trace_printf(const char * fmt, ...) {
+	struct trace_buf * buf = trace_cur;
+	va_list ap, aq;
+	int n;
+
+	va_start(ap, fmt);
+	if (buf == NULL) {
+		vfprintf(trace_stream(trace_ctx_cur), fmt, ap);
+		va_end(ap);
+		return;
+	}
+	if (buf->cap == 0)
+		trace_reserve(buf, 0);
+	va_copy(aq, ap);
+	n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, aq);
+	va_end(aq);
+	if (n > 0 && buf->len + n >= buf->cap) {
+		/* Did not fit, print again into a large enough buffer */
+		trace_reserve(buf, n);
+		vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+	}
+	if (n > 0)
+		buf->len += n;
+	va_end(ap);
+}
+
+void trace_flush(struct trace_ctx * ctx, struct trace_buf * buf) {
+	if (buf->len == 0)
+		return;
+	fwrite(buf->data, 1, buf->len, trace_stream(ctx));
+	buf->len = 0;
+}
+
+void trace_free(struct trace_buf * buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->cap = 0;
+}
+
+int trace_ev_open(struct trace_ctx * ctx, const char * path) {
+	struct trace_ev_hdr hdr = {
+		.magic = TRACE_EV_MAGIC,
+		.version = TRACE_EV_VERSION,
+		.rec_size = sizeof(struct trace_ev),
+	};
+
+	ctx->evfile = fopen(path, "wb");
+	if (ctx->evfile == NULL)
+		return -1;
+	fwrite(&hdr, sizeof(hdr), 1, ctx->evfile);
+	return 0;
+}
+
+void trace_ev_close(struct trace_ctx * ctx) {
+	if (ctx->evfile == NULL)
+		return;
+	fclose(ctx->evfile);
+	ctx->evfile = NULL;
+}
+
+void trace_event(int type, uint32_t pid, uint32_t a0, uint32_t a1) {
+	struct trace_buf * buf = trace_ev_cur;
+	struct trace_ev ev = {
+		.time = 0,
+		.pid = pid,
+		.type = type,
+		.cpu = trace_cpu < 0 ? TRACE_EV_NOCPU : trace_cpu,
+		.arg = { a0, a1 },
+	};
+
+	if (buf == NULL) {
+		/* No clock around, log it as slot 0 */
+		fwrite(&ev, sizeof(ev), 1, trace_ctx_cur->evfile);
+		return;
+	}
+	trace_reserve(buf, sizeof(ev));
+	memcpy(buf->data + buf->len, &ev, sizeof(ev));
+	buf->len += sizeof(ev);
+}
+
+void trace_ev_flush(struct trace_ctx * ctx, struct trace_buf * events,
+		uint64_t time) {
+	size_t off;
+
+	if (events->len == 0)
+		return;
+	for (off = 0; off < events->len; off += sizeof(struct trace_ev))
+		((struct trace_ev *)(events->data + off))->time = time;
+	if (ctx->evfile != NULL)
+		fwrite(events->data, 1, events->len, ctx->evfile);
+	events->len = 0;
+}
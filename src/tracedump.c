@@ -0,0 +1,253 @@
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Event log reader: renders a log written by os -e back into the text
+ * trace, or with -s into per-type, per-process and per-CPU statistics.
+ * Usage: tracedump [-s] <event log>
+ */
+
+static const char * ev_names[EV_NR_TYPES] = {
+	[EV_LOAD] = "load",
+	[EV_DISPATCH] = "dispatch",
+	[EV_PREEMPT] = "preempt",
+	[EV_FINISH] = "finish",
+	[EV_ALLOC] = "alloc",
+	[EV_FREE] = "free",
+	[EV_PGFAULT] = "pgfault",
+	[EV_SWAPIN] = "swapin",
+	[EV_SWAPOUT] = "swapout",
+	[EV_TLBHIT] = "tlbhit",
+	[EV_TLBMISS] = "tlbmiss",
+	[EV_WRITEBACK] = "writeback",
+};
+
+/* Record layout of version 1 logs, before the pid was widened */
+struct trace_ev_v1 {
+	uint32_t time;
+	uint16_t pid;
+	uint8_t type;
+	uint8_t cpu;
+	uint32_t arg[2];
+};
+
+/* Read the next record of a log of [version] into [ev]. Return 0 at
+ * the end of the log */
+static int read_event(FILE * log, int version, struct trace_ev * ev) {
+	struct trace_ev_v1 old;
+
+	if (version != 1)
+		return fread(ev, sizeof(*ev), 1, log) == 1;
+	if (fread(&old, sizeof(old), 1, log) != 1)
+		return 0;
+	memset(ev, 0, sizeof(*ev));
+	ev->time = old.time;
+	ev->pid = old.pid;
+	ev->type = old.type;
+	ev->cpu = old.cpu;
+	ev->arg[0] = old.arg[0];
+	ev->arg[1] = old.arg[1];
+	return 1;
+}
+
+/* Print [ev] the way the simulator traces it. The log keeps no paths
+ * or values, so loads and memory instructions are rendered shorter */
+static void print_event(const struct trace_ev * ev) {
+	int cpu = ev->cpu == TRACE_EV_NOCPU ? -1 : ev->cpu;
+
+	switch (ev->type) {
+	case EV_LOAD:
+		printf("\tLoaded a process, PID: %u PRIO: %u\n", ev->pid, ev->arg[0]);
+		break;
+	case EV_DISPATCH:
+		printf("\tCPU %d: Dispatched process %2u\n", cpu, ev->pid);
+		break;
+	case EV_PREEMPT:
+		printf("\tCPU %d: Put process %2u to run queue\n", cpu, ev->pid);
+		break;
+	case EV_FINISH:
+		printf("\tCPU %d: Processed %2u has finished\n", cpu, ev->pid);
+		break;
+	case EV_ALLOC:
+		printf("\tProcess %u alloc region=%u size=%u\n",
+			ev->pid, ev->arg[0], ev->arg[1]);
+		break;
+	case EV_FREE:
+		printf("\tProcess %u free region %u\n", ev->pid, ev->arg[0]);
+		break;
+	case EV_PGFAULT:
+		printf("\tProcess %u page fault page=%u\n", ev->pid, ev->arg[0]);
+		break;
+	case EV_SWAPIN:
+		printf("\tProcess %u swap in page=%u frame=%u\n",
+			ev->pid, ev->arg[0], ev->arg[1]);
+		break;
+	case EV_SWAPOUT:
+		printf("\tProcess %u swap out page=%u swap frame=%u\n",
+			ev->pid, ev->arg[0], ev->arg[1]);
+		break;
+	case EV_TLBHIT:
+		printf("\tTLB hit at region=%u offset=%u, PID: %u\n",
+			ev->arg[0], ev->arg[1], ev->pid);
+		break;
+	case EV_TLBMISS:
+		printf("\tTLB miss at region=%u offset=%u, PID: %u\n",
+			ev->arg[0], ev->arg[1], ev->pid);
+		break;
+	case EV_WRITEBACK:
+		printf("\tProcess %u write back page=%u swap frame=%u\n",
+			ev->pid, ev->arg[0], ev->arg[1]);
+		break;
+	default:
+		printf("\tUnknown event %d, PID: %u\n", ev->type, ev->pid);
+	}
+}
+
+struct proc_stat {
+	int seen;
+	uint32_t prio;
+	uint32_t load;
+	uint32_t finish;	// 0 while not finished
+	unsigned long count[EV_NR_TYPES];
+};
+
+struct summary {
+	unsigned long count[EV_NR_TYPES];
+	unsigned long cpu_dispatch[TRACE_EV_NOCPU];
+	int nr_cpus;
+	struct proc_stat * procs;	// Indexed by PID
+	uint32_t nr_procs;
+	uint32_t last;
+	unsigned long nr_events;
+};
+
+static void account(struct summary * sum, const struct trace_ev * ev) {
+	struct proc_stat * p;
+
+	sum->nr_events++;
+	sum->last = ev->time;
+	if (ev->type >= EV_NR_TYPES)
+		return;
+	sum->count[ev->type]++;
+	if (ev->type == EV_DISPATCH && ev->cpu != TRACE_EV_NOCPU) {
+		sum->cpu_dispatch[ev->cpu]++;
+		if (ev->cpu >= sum->nr_cpus)
+			sum->nr_cpus = ev->cpu + 1;
+	}
+
+	if (ev->pid >= sum->nr_procs) {
+		uint32_t nr = ev->pid + 1;
+		sum->procs = realloc(sum->procs, nr * sizeof(struct proc_stat));
+		memset(sum->procs + sum->nr_procs, 0,
+			(nr - sum->nr_procs) * sizeof(struct proc_stat));
+		sum->nr_procs = nr;
+	}
+	p = &sum->procs[ev->pid];
+	p->seen = 1;
+	p->count[ev->type]++;
+	if (ev->type == EV_LOAD) {
+		p->prio = ev->arg[0];
+		p->load = ev->time;
+	} else if (ev->type == EV_FINISH) {
+		p->finish = ev->time;
+	}
+}
+
+static void print_summary(const struct summary * sum) {
+	unsigned long hit = sum->count[EV_TLBHIT], miss = sum->count[EV_TLBMISS];
+	uint32_t pid;
+	int i;
+
+	printf("slots: %u events: %lu\n", sum->last + 1, sum->nr_events);
+	for (i = 0; i < EV_NR_TYPES; i++)
+		printf("%-10s %lu\n", ev_names[i], sum->count[i]);
+	if (hit + miss > 0)
+		printf("tlb hit rate: %.2f%%\n", 100.0 * hit / (hit + miss));
+
+	printf("\n%4s %4s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n", "pid", "prio",
+		"load", "finish", "turn", "disp", "fault", "swpin", "swpout",
+		"tlbhit", "tlbmis");
+	for (pid = 0; pid < sum->nr_procs; pid++) {
+		const struct proc_stat * p = &sum->procs[pid];
+		if (!p->seen)
+			continue;
+		printf("%4u %4u %6u ", pid, p->prio, p->load);
+		if (p->count[EV_FINISH])
+			printf("%6u %6u ", p->finish, p->finish - p->load);
+		else
+			printf("%6s %6s ", "-", "-");
+		printf("%6lu %6lu %6lu %6lu %6lu %6lu\n", p->count[EV_DISPATCH],
+			p->count[EV_PGFAULT], p->count[EV_SWAPIN],
+			p->count[EV_SWAPOUT], p->count[EV_TLBHIT],
+			p->count[EV_TLBMISS]);
+	}
+
+	printf("\n%4s %6s\n", "cpu", "disp");
+	for (i = 0; i < sum->nr_cpus; i++)
+		printf("%4d %6lu\n", i, sum->cpu_dispatch[i]);
+}
+
+int main(int argc, char * argv[]) {
+	struct trace_ev_hdr hdr;
+	struct trace_ev ev;
+	struct summary sum;
+	uint64_t slot = 0;
+	int stats = 0;
+	FILE * log;
+	int c;
+
+	while ((c = getopt(argc, argv, "s")) != -1) {
+		switch (c) {
+		case 's':
+			stats = 1;
+			break;
+		default:
+			printf("Usage: tracedump [-s] [event log]\n");
+			return 1;
+		}
+	}
+	if (argc - optind != 1) {
+		printf("Usage: tracedump [-s] [event log]\n");
+		return 1;
+	}
+
+	if ((log = fopen(argv[optind], "rb")) == NULL) {
+		printf("Cannot open %s\n", argv[optind]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, log) != 1 ||
+			memcmp(hdr.magic, TRACE_EV_MAGIC, sizeof(hdr.magic)) != 0 ||
+			(hdr.version == 1 ?
+			 hdr.rec_size != sizeof(struct trace_ev_v1) :
+			 hdr.version != TRACE_EV_VERSION ||
+			 hdr.rec_size != sizeof(struct trace_ev))) {
+		printf("%s is not an event log\n", argv[optind]);
+		fclose(log);
+		return 1;
+	}
+
+	memset(&sum, 0, sizeof(sum));
+	if (!stats)
+		printf("Time slot %3lu\n", (unsigned long)slot);
+	while (read_event(log, hdr.version, &ev)) {
+		if (stats) {
+			account(&sum, &ev);
+			continue;
+		}
+		/* Only slots that logged anything are known, the empty
+		 * ones in between are filled in */
+		while (slot < ev.time)
+			printf("Time slot %3lu\n", (unsigned long)++slot);
+		print_event(&ev);
+	}
+	fclose(log);
+
+	if (stats)
+		print_summary(&sum);
+	free(sum.procs);
+	return 0;
+}
@@ -0,0 +1,384 @@
+
+#include "loader.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Synthetic workload generator. Writes the config input/[name] and one
+ * program per process (or per distinct program with -u) under
+ * input/proc/[name]/, laid out the way read_config() and load() expect
+ * for the options in os-cfg.h.
+ *
+ * Memory instructions work on a set of regions: ALLOC fills a free
+ * region slot (FREE-ing a live one first when all are taken), READ and
+ * WRITE pick a live region and an offset inside it. With locality L an
+ * access stays in the previous region, close to the previous offset,
+ * with probability L.
+ *
+ * A memory-heavy run at scale, 10000 processes sharing 100 programs on a
+ * 64KB RAM so that the pages keep moving to and from swap:
+ *
+ *	./wlgen -n 10000 -u 100 -g 0.05 -i 100 -w 8 -m 10:20:35:35 \
+ *		-r 65536 wlbig
+ *	./os-des -v 1 -e wlbig.events wlbig
+ *	./tracedump -s wlbig.events
+ *
+ * Every process finishes, after about 184k page faults and 296k swap-outs.
+ * At -v 3 each memory instruction dumps the RAM, which makes the trace
+ * far too large at this scale.
+ */
+
+#define WL_MAX_REGIONS	10	/* struct pcb_t has 10 registers */
+
+struct wl_opts {
+	const char * name;
+	int nr_procs;
+	int nr_progs;		// Distinct programs, 0 for one per process
+	int nr_cpus;
+	int time_slot;
+	const char * arrival;	// burst, fixed, uniform or poisson
+	double gap;		// Mean slots between two arrivals
+	int prio_min;
+	int prio_max;
+	double prio_skew;	// 0 uniform, >0 favours prio_min
+	int insts;		// Mean instructions per program
+	int mix[4];		// CALC:ALLOC:READ:WRITE weights
+	int regions;		// Working set, in regions
+	int region_sz;		// Largest region in bytes
+	double locality;
+	int ramsz;
+	int swpsz;
+	const char * policy;	// Page replacement, NULL keeps the default
+	int compiled;
+	unsigned long seed;
+};
+
+static uint64_t rng_state;
+
+/* xorshift64*, keeps a run reproducible from its seed on every libc */
+static uint64_t rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double rng_unit(void) {
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Uniform in [lo, hi] */
+static int rng_range(int lo, int hi) {
+	return lo + (int)(rng() % (uint64_t)(hi - lo + 1));
+}
+
+/* Arrival after one at [t]. Kept fractional so the mean gap holds
+ * for gaps under a slot, the config gets the slot it falls in */
+static double next_arrival(struct wl_opts * o, double t) {
+	if (!strcmp(o->arrival, "burst"))
+		return 0;
+	if (!strcmp(o->arrival, "fixed"))
+		return t + o->gap;
+	if (!strcmp(o->arrival, "uniform"))
+		return t + rng_unit() * 2 * o->gap;
+	/* poisson: exponential gaps */
+	return t - log(1.0 - rng_unit()) * o->gap;
+}
+
+static int pick_prio(struct wl_opts * o) {
+	double u = rng_unit();
+
+	if (o->prio_skew > 0)
+		u = pow(u, 1.0 + o->prio_skew);
+	return o->prio_min + (int)(u * (o->prio_max - o->prio_min + 1));
+}
+
+/* Generate one program into [text] */
+static void gen_program(struct wl_opts * o, struct code_seg_t * code) {
+	uint32_t size[WL_MAX_REGIONS] = { 0 };
+	int total = o->mix[0] + o->mix[1] + o->mix[2] + o->mix[3];
+	int last = -1, last_off = 0;
+	uint32_t i;
+
+	code->size = rng_range((o->insts + 1) / 2, o->insts + o->insts / 2);
+	code->text = calloc(code->size, sizeof(struct inst_t));
+	for (i = 0; i < code->size; i++) {
+		struct inst_t * inst = &code->text[i];
+		int live[WL_MAX_REGIONS], nr_live = 0, r, w;
+
+		for (r = 0; r < o->regions; r++)
+			if (size[r] != 0)
+				live[nr_live++] = r;
+
+		w = rng_range(0, total - 1);
+		if (w < o->mix[0]) {
+			inst->opcode = CALC;
+			continue;
+		}
+		w -= o->mix[0];
+		if (w < o->mix[1] || nr_live == 0) {
+			/* Reuse a slot once the working set is full */
+			if (nr_live == o->regions) {
+				r = live[rng_range(0, nr_live - 1)];
+				inst->opcode = FREE;
+				inst->arg_0 = r;
+				size[r] = 0;
+				if (r == last)
+					last = -1;
+				continue;
+			}
+			for (r = 0; size[r] != 0; r++);
+			inst->opcode = ALLOC;
+			inst->arg_0 = rng_range(1, o->region_sz);
+			inst->arg_1 = r;
+			size[r] = inst->arg_0;
+			continue;
+		}
+		w -= o->mix[1];
+
+		/* READ or WRITE in a live region */
+		if (last >= 0 && rng_unit() < o->locality) {
+			r = last;
+			last_off += rng_range(-8, 8);
+			if (last_off < 0)
+				last_off = 0;
+			if ((uint32_t)last_off >= size[r])
+				last_off = size[r] - 1;
+		} else {
+			r = live[rng_range(0, nr_live - 1)];
+			last_off = rng_range(0, size[r] - 1);
+		}
+		last = r;
+		if (w < o->mix[2]) {
+			inst->opcode = READ;
+			inst->arg_0 = r;
+			inst->arg_1 = last_off;
+			inst->arg_2 = 0;
+		} else {
+			inst->opcode = WRITE;
+			inst->arg_0 = rng_range(0, 255);
+			inst->arg_1 = r;
+			inst->arg_2 = last_off;
+		}
+	}
+}
+
+static int write_text(const char * path, struct code_seg_t * code,
+		uint32_t priority) {
+	static const char * const opt[] = {
+		"calc", "alloc", "free", "read", "write"
+	};
+	FILE * file;
+	uint32_t i;
+
+	if ((file = fopen(path, "w")) == NULL)
+		return -1;
+	fprintf(file, "%u %u\n", priority, code->size);
+	for (i = 0; i < code->size; i++) {
+		struct inst_t * inst = &code->text[i];
+		switch (inst->opcode) {
+		case CALC:
+			fprintf(file, "%s\n", opt[inst->opcode]);
+			break;
+		case ALLOC:
+			fprintf(file, "%s %u %u\n", opt[inst->opcode],
+				inst->arg_0, inst->arg_1);
+			break;
+		case FREE:
+			fprintf(file, "%s %u\n", opt[inst->opcode], inst->arg_0);
+			break;
+		default:
+			fprintf(file, "%s %u %u %u\n", opt[inst->opcode],
+				inst->arg_0, inst->arg_1, inst->arg_2);
+		}
+	}
+	return fclose(file);
+}
+
+static int write_compiled(const char * path, struct code_seg_t * code,
+		uint32_t priority) {
+	struct prog_header hdr;
+	FILE * file;
+
+	hdr.magic = PROG_MAGIC;
+	hdr.version = PROG_VERSION;
+	hdr.priority = priority;
+	hdr.size = code->size;
+	if ((file = fopen(path, "wb")) == NULL)
+		return -1;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+			fwrite(code->text, sizeof(struct inst_t),
+				code->size, file) != code->size) {
+		fclose(file);
+		return -1;
+	}
+	return fclose(file);
+}
+
+static int generate(struct wl_opts * o) {
+	char path[100];
+	double start = 0;
+	long total = 0;
+	FILE * cfg;
+	int i;
+
+	snprintf(path, sizeof(path), "input/proc/%s", o->name);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		printf("Cannot create %s\n", path);
+		return 1;
+	}
+
+	/* Programs */
+	for (i = 0; i < o->nr_progs; i++) {
+		struct code_seg_t code;
+		int err;
+
+		gen_program(o, &code);
+		snprintf(path, sizeof(path), "input/proc/%s/p%d", o->name, i);
+		if (o->compiled)
+			err = write_compiled(path, &code, pick_prio(o));
+		else
+			err = write_text(path, &code, pick_prio(o));
+		total += code.size;
+		free(code.text);
+		if (err) {
+			printf("Cannot write %s\n", path);
+			return 1;
+		}
+	}
+
+	/* Config, see read_config() in os.c */
+	snprintf(path, sizeof(path), "input/%s", o->name);
+	if ((cfg = fopen(path, "w")) == NULL) {
+		printf("Cannot create %s\n", path);
+		return 1;
+	}
+	fprintf(cfg, "%d %d %d\n", o->time_slot, o->nr_cpus, o->nr_procs);
+#if defined(CPU_TLB) && !defined(CPUTLB_FIXED_TLBSZ)
+	fprintf(cfg, "%d\n", 0x10000);
+#endif
+#if defined(MM_PAGING) && !defined(MM_FIXED_MEMSZ)
+	int sit;
+	fprintf(cfg, "%d %d", o->ramsz, o->swpsz);
+	for (sit = 1; sit < PAGING_MAX_MMSWP; sit++)
+		fprintf(cfg, " 0");
+	fprintf(cfg, "\n");
+#endif
+#ifdef MM_PAGING
+	if (o->policy != NULL)
+		fprintf(cfg, "policy %s\n", o->policy);
+#endif
+	for (i = 0; i < o->nr_procs; i++) {
+		int prog = o->nr_progs == o->nr_procs ? i : rng_range(0, o->nr_progs - 1);
+		if (i > 0)
+			start = next_arrival(o, start);
+#ifdef MLQ_SCHED
+		fprintf(cfg, "%lu %s/p%d %d\n", (unsigned long)start,
+			o->name, prog, pick_prio(o));
+#else
+		fprintf(cfg, "%lu %s/p%d\n", (unsigned long)start, o->name, prog);
+#endif
+	}
+	fclose(cfg);
+
+	printf("%s: %d processes, %d programs, %ld instructions, last arrival at %lu\n",
+		o->name, o->nr_procs, o->nr_progs, total, (unsigned long)start);
+	return 0;
+}
+
+static void usage(void) {
+	printf("Usage: wlgen [options] name\n");
+	printf("  -n N        processes (100)\n");
+	printf("  -u N        distinct programs shared by the processes (one each)\n");
+	printf("  -c N        CPUs (4)\n");
+	printf("  -t N        time slot (2)\n");
+	printf("  -a DIST     arrivals: burst, fixed, uniform or poisson (poisson)\n");
+	printf("  -g SLOTS    mean gap between arrivals (1)\n");
+	printf("  -p MIN:MAX  priority range (0:%d)\n", MAX_PRIO - 1);
+	printf("  -k SKEW     priority skew towards MIN, 0 is uniform (0)\n");
+	printf("  -i N        mean instructions per program (50)\n");
+	printf("  -m C:A:R:W  CALC:ALLOC:READ:WRITE weights (40:10:25:25)\n");
+	printf("  -w N        regions in the working set, at most %d (4)\n", WL_MAX_REGIONS);
+	printf("  -z BYTES    largest region (512)\n");
+	printf("  -l P        access locality in [0, 1] (0.5)\n");
+	printf("  -r BYTES    RAM size (1048576)\n");
+	printf("  -x BYTES    swap size (16777216)\n");
+	printf("  -P POLICY   page replacement: fifo, clock or aging (fifo)\n");
+	printf("  -b          write compiled programs, see progc\n");
+	printf("  -s SEED     random seed (1)\n");
+}
+
+int main(int argc, char * argv[]) {
+	struct wl_opts o = {
+		.nr_procs = 100, .nr_cpus = 4, .time_slot = 2,
+		.arrival = "poisson", .gap = 1,
+		.prio_min = 0, .prio_max = MAX_PRIO - 1,
+		.insts = 50, .mix = { 40, 10, 25, 25 },
+		.regions = 4, .region_sz = 512, .locality = 0.5,
+		.ramsz = 1048576, .swpsz = 16777216, .seed = 1,
+	};
+	int c;
+
+	while ((c = getopt(argc, argv, "n:u:c:t:a:g:p:k:i:m:w:z:l:r:x:P:bs:")) != -1) {
+		switch (c) {
+		case 'n': o.nr_procs = atoi(optarg); break;
+		case 'u': o.nr_progs = atoi(optarg); break;
+		case 'c': o.nr_cpus = atoi(optarg); break;
+		case 't': o.time_slot = atoi(optarg); break;
+		case 'a': o.arrival = optarg; break;
+		case 'g': o.gap = atof(optarg); break;
+		case 'p':
+			if (sscanf(optarg, "%d:%d", &o.prio_min, &o.prio_max) != 2)
+				o.prio_min = -1;
+			break;
+		case 'k': o.prio_skew = atof(optarg); break;
+		case 'i': o.insts = atoi(optarg); break;
+		case 'm':
+			if (sscanf(optarg, "%d:%d:%d:%d", &o.mix[0], &o.mix[1],
+					&o.mix[2], &o.mix[3]) != 4)
+				o.mix[0] = -1;
+			break;
+		case 'w': o.regions = atoi(optarg); break;
+		case 'z': o.region_sz = atoi(optarg); break;
+		case 'l': o.locality = atof(optarg); break;
+		case 'r': o.ramsz = atoi(optarg); break;
+		case 'x': o.swpsz = atoi(optarg); break;
+		case 'P': o.policy = optarg; break;
+		case 'b': o.compiled = 1; break;
+		case 's': o.seed = strtoul(optarg, NULL, 0); break;
+		default: usage(); return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	o.name = argv[optind];
+	if (o.nr_progs <= 0 || o.nr_progs > o.nr_procs)
+		o.nr_progs = o.nr_procs;
+
+	if (o.nr_procs < 1 || o.nr_cpus < 1 || o.time_slot < 1 || o.insts < 1 ||
+			o.prio_min < 0 || o.prio_max >= MAX_PRIO ||
+			o.prio_min > o.prio_max ||
+			o.mix[0] < 0 || o.mix[1] < 0 || o.mix[2] < 0 || o.mix[3] < 0 ||
+			o.mix[0] + o.mix[1] + o.mix[2] + o.mix[3] == 0 ||
+			o.regions < 1 || o.regions > WL_MAX_REGIONS ||
+			o.region_sz < 1 || o.gap < 0 ||
+			(o.policy != NULL && strcmp(o.policy, "fifo") &&
+			strcmp(o.policy, "clock") && strcmp(o.policy, "aging")) ||
+			(strcmp(o.arrival, "burst") && strcmp(o.arrival, "fixed") &&
+			strcmp(o.arrival, "uniform") && strcmp(o.arrival, "poisson"))) {
+		usage();
+		return 1;
+	}
+
+	rng_state = o.seed ? o.seed : 1;
+	return generate(&o);
+}